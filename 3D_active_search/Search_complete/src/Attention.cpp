@@ -14,129 +14,634 @@
 using namespace cv;
 using namespace std;
 
+// Color spaces that are affine transforms of the BGR input. Each row maps (b, g, r) to one
+// output channel as m*x + bias. When normalization is requested the channel becomes
+// (m*x + bias + normOffset)*normScale, which is folded into a single matrix before conversion.
+struct AffineColorSpace
+{
+	colorSpace type;
+	int channels;
+	bool clampNegative; // clamp negative normalized values to zero
+	float m[3][3];
+	float bias[3];
+	float normOffset[3];
+	float normScale[3];
+};
+
+static constexpr AffineColorSpace affineColorSpaces[] = {
+	{CMY, 3, false,
+		{{0.f, 0.f, -1.f}, {0.f, -1.f, 0.f}, {-1.f, 0.f, 0.f}},
+		{1.f, 1.f, 1.f}, {0.f, 0.f, 0.f}, {1.f, 1.f, 1.f}},
+	// O1 = (R-G)/sqrt(2), O2 = (R+G-2B)/sqrt(6)
+	{COPP, 2, true,
+		{{0.f, -0.70710678f, 0.70710678f}, {-0.81649658f, 0.40824829f, 0.40824829f}, {0.f, 0.f, 0.f}},
+		{0.f, 0.f, 0.f}, {0.70710678f, 0.81649658f, 0.f}, {0.70710678f, 0.61237244f, 1.f}},
+	{XYZ, 3, false,
+		{{0.180423f, 0.357580f, 0.412453f}, {0.072169f, 0.715160f, 0.212671f}, {0.950227f, 0.119193f, 0.019334f}},
+		{0.f, 0.f, 0.f}, {0.f, 0.f, 0.f}, {1.f/0.950456f, 1.f, 1.f/1.088754f}},
+	{YIQ, 3, false,
+		{{0.114f, 0.587f, 0.299f}, {-0.322f, -0.274f, 0.596f}, {-0.312f, -0.523f, 0.211f}},
+		{0.f, 0.f, 0.f}, {0.f, 0.596f, 0.835f}, {1.f, 1.f/1.192f, 1.f/1.046f}},
+	// U = 0.66X, V = Y, W = -0.5X + 1.5Y + 0.5Z applied to the XYZ rows
+	{UVW, 3, false,
+		{{0.66f*0.180423f, 0.66f*0.357580f, 0.66f*0.412453f},
+		 {0.072169f, 0.715160f, 0.212671f},
+		 {-0.5f*0.180423f + 1.5f*0.072169f + 0.5f*0.950227f,
+		  -0.5f*0.357580f + 1.5f*0.715160f + 0.5f*0.119193f,
+		  -0.5f*0.412453f + 1.5f*0.212671f + 0.5f*0.019334f}},
+		{0.f, 0.f, 0.f}, {0.f, 0.f, 0.f}, {1.f/0.66f, 1.f, 1.f/1.569149f}},
+	// U = 0.492(B-Y), V = 0.77(R-Y)
+	{YUV, 3, false,
+		{{0.114f, 0.587f, 0.299f},
+		 {0.492f*(1.f-0.114f), -0.492f*0.587f, -0.492f*0.299f},
+		 {-0.77f*0.114f, -0.77f*0.587f, 0.77f*(1.f-0.299f)}},
+		{0.f, 0.f, 0.f}, {0.f, 0.435912f, 0.53977f}, {1.f, 1.f/0.871824f, 1.f/1.07954f}},
+	// O3 = (R+G+B)/sqrt(3) is divided by 1/sqrt(3) when normalized
+	{OPP, 3, true,
+		{{0.f, -0.70710678f, 0.70710678f}, {-0.81649658f, 0.40824829f, 0.40824829f}, {0.57735027f, 0.57735027f, 0.57735027f}},
+		{0.f, 0.f, 0.f}, {0.70710678f, 0.81649658f, 0.f}, {0.70710678f, 0.61237244f, 1.7320508f}},
+	{YES, 3, false,
+		{{0.063f, 0.684f, 0.253f}, {0.f, -0.5f, 0.5f}, {-0.5f, 0.25f, 0.25f}},
+		{0.f, 0.f, 0.f}, {0.f, 0.5f, 0.5f}, {1.f, 1.f, 1.f}},
+	{I1I2I3, 3, false,
+		{{1.f/3.f, 1.f/3.f, 1.f/3.f}, {-0.5f, 0.f, 0.5f}, {-0.25f, 0.5f, -0.25f}},
+		{0.f, 0.f, 0.f}, {0.f, 0.5f, 0.5f}, {1.f, 1.f, 1.f}}
+};
+
+// Converts a scaled BGR image to one of the affine color spaces in a single transform pass.
+// Returns false if the color space is not affine.
+static bool affineColorConversion(const cv::Mat &scaledImage, cv::Mat &output, colorSpace type, bool norm)
+{
+	for (size_t s = 0; s < sizeof(affineColorSpaces)/sizeof(affineColorSpaces[0]); s++)
+	{
+		const AffineColorSpace &space = affineColorSpaces[s];
+		if (space.type != type)
+			continue;
+
+		float coeffs[3][4];
+		for (int r = 0; r < space.channels; r++)
+		{
+			float offset = norm ? space.normOffset[r] : 0.f;
+			float scale = norm ? space.normScale[r] : 1.f;
+			for (int c = 0; c < 3; c++)
+				coeffs[r][c] = space.m[r][c]*scale;
+			coeffs[r][3] = (space.bias[r] + offset)*scale;
+		}
+		transform(scaledImage, output, Mat(space.channels, 4, CV_32F, coeffs));
+
+		if (norm && space.clampNegative)
+			threshold(output, output, 0, 0, THRESH_TOZERO);
+		return true;
+	}
+	return false;
+}
+
+// Pixel-wise chromaticity normalization, 255*c/(b + g + r) truncated to 8 bits for each channel c.
+// The float path adds 1/2048 to c*(255/sum) before truncating, which reproduces the double precision
+// floor(c/sum*255) for every possible 8-bit pixel. The table path uses the integer reciprocals below.
+#define PIXEL_WISE_EPS (1.f/2048.f)
+#define PIXEL_WISE_SHIFT 20
+
+// ceil((255 << PIXEL_WISE_SHIFT)/sum) for every channel sum of an 8-bit BGR pixel
+struct PixelWiseTable
+{
+	unsigned int recip[766];
+	PixelWiseTable()
+	{
+		recip[0] = 0;
+		for (unsigned int s = 1; s < 766; s++)
+			recip[s] = ((255u << PIXEL_WISE_SHIFT) + s - 1)/s;
+	}
+};
+
+#if CV_SIMD128
+static inline void pixelWiseReciprocal(const v_uint16x8 &sum, v_float32x4 &lo, v_float32x4 &hi)
+{
+	v_uint32x4 s0, s1;
+	v_expand(sum, s0, s1);
+	v_float32x4 one = v_setall_f32(1.f), k = v_setall_f32(255.f);
+	lo = k / v_max(v_cvt_f32(v_reinterpret_as_s32(s0)), one);
+	hi = k / v_max(v_cvt_f32(v_reinterpret_as_s32(s1)), one);
+}
+static inline v_int16x8 pixelWiseScale(const v_uint16x8 &channel, const v_float32x4 &lo, const v_float32x4 &hi)
+{
+	v_uint32x4 c0, c1;
+	v_expand(channel, c0, c1);
+	v_float32x4 eps = v_setall_f32(PIXEL_WISE_EPS);
+	return v_pack(v_trunc(v_cvt_f32(v_reinterpret_as_s32(c0))*lo + eps),
+			v_trunc(v_cvt_f32(v_reinterpret_as_s32(c1))*hi + eps));
+}
+#endif
+
+// Normalizes a range of rows of an 8-bit BGR image. dst may be the same image as src.
+class PixelWiseNormalizer : public cv::ParallelLoopBody
+{
+public:
+	PixelWiseNormalizer(const cv::Mat &src, cv::Mat &dst, const unsigned int *recip = NULL)
+	: src(src), dst(dst), recip(recip) {}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		for (int i = range.start; i < range.end; i++)
+		{
+			const uchar* s = src.ptr<uchar>(i);
+			uchar* d = dst.ptr<uchar>(i);
+			if (recip)
+				tableRow(s, d, src.cols);
+			else
+				floatRow(s, d, src.cols);
+		}
+	}
+
+private:
+	void floatRow(const uchar* src, uchar* dst, int cols) const
+	{
+		int j = 0;
+#if CV_SIMD128
+		for (; j <= cols - 16; j += 16)
+		{
+			v_uint8x16 b, g, r;
+			v_uint16x8 b0, b1, g0, g1, r0, r1;
+			v_float32x4 rcp0, rcp1, rcp2, rcp3;
+			v_load_deinterleave(src + j*3, b, g, r);
+			v_expand(b, b0, b1);
+			v_expand(g, g0, g1);
+			v_expand(r, r0, r1);
+			pixelWiseReciprocal(b0 + g0 + r0, rcp0, rcp1);
+			pixelWiseReciprocal(b1 + g1 + r1, rcp2, rcp3);
+			b = v_pack_u(pixelWiseScale(b0, rcp0, rcp1), pixelWiseScale(b1, rcp2, rcp3));
+			g = v_pack_u(pixelWiseScale(g0, rcp0, rcp1), pixelWiseScale(g1, rcp2, rcp3));
+			r = v_pack_u(pixelWiseScale(r0, rcp0, rcp1), pixelWiseScale(r1, rcp2, rcp3));
+			v_store_interleave(dst + j*3, b, g, r);
+		}
+#endif
+		for (; j < cols; j++)
+		{
+			int b = src[j*3], g = src[j*3+1], r = src[j*3+2];
+			float rcp = 255.f/max(b + g + r, 1);
+			dst[j*3] = (uchar)(b*rcp + PIXEL_WISE_EPS);
+			dst[j*3+1] = (uchar)(g*rcp + PIXEL_WISE_EPS);
+			dst[j*3+2] = (uchar)(r*rcp + PIXEL_WISE_EPS);
+		}
+	}
+	void tableRow(const uchar* src, uchar* dst, int cols) const
+	{
+		for (int j = 0; j < cols*3; j += 3)
+		{
+			unsigned int b = src[j], g = src[j+1], r = src[j+2];
+			unsigned int k = recip[b + g + r];
+			dst[j] = (uchar)((b*k) >> PIXEL_WISE_SHIFT);
+			dst[j+1] = (uchar)((g*k) >> PIXEL_WISE_SHIFT);
+			dst[j+2] = (uchar)((r*k) >> PIXEL_WISE_SHIFT);
+		}
+	}
+
+	const cv::Mat &src;
+	cv::Mat &dst;
+	const unsigned int *recip;
+};
+
+// CHANNEL_WISE, OPPONENT_AXIS and COMPREHENSIVE normalize each channel with statistics of the whole
+// image. Every output channel only depends on an integer key of the pixel, so one pass builds a
+// histogram of the keys and a second pass applies a lookup table built from it:
+//   CHANNEL_WISE   b, g, r
+//   OPPONENT_AXIS  2r + g (negated), r + b, r + g + b, the axes the in-place channel arithmetic
+//                  of the double precision version ended up with
+//   COMPREHENSIVE  1 where the channel holds all of the intensity, 0 otherwise
+#define NORMALIZATION_KEYS 766
+
+static inline void normalizationKeys(const uchar* p, int method, int &k0, int &k1, int &k2)
+{
+	int b = p[0], g = p[1], r = p[2];
+	if (method == OPPONENT_AXIS)
+	{
+		k0 = 2*r + g;
+		k1 = r + b;
+		k2 = r + g + b;
+	}else
+		if (method == COMPREHENSIVE)
+		{
+			int s = b + g + r;
+			k0 = (s > 0 && b == s);
+			k1 = (s > 0 && g == s);
+			k2 = (s > 0 && r == s);
+		}else
+		{
+			k0 = b;
+			k1 = g;
+			k2 = r;
+		}
+}
+
+// Accumulates the key histograms of a range of rows
+class NormalizationHistogram : public cv::ParallelLoopBody
+{
+public:
+	NormalizationHistogram(const cv::Mat &src, int method, unsigned int (*hist)[NORMALIZATION_KEYS], cv::Mutex &mutex)
+	: src(src), method(method), hist(hist), mutex(mutex) {}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		unsigned int local[3][NORMALIZATION_KEYS] = {};
+		int k0, k1, k2;
+		for (int i = range.start; i < range.end; i++)
+		{
+			const uchar* s = src.ptr<uchar>(i);
+			for (int j = 0; j < src.cols*3; j += 3)
+			{
+				normalizationKeys(s + j, method, k0, k1, k2);
+				local[0][k0]++;
+				local[1][k1]++;
+				local[2][k2]++;
+			}
+		}
+		cv::AutoLock lock(mutex);
+		for (int c = 0; c < 3; c++)
+			for (int k = 0; k < NORMALIZATION_KEYS; k++)
+				hist[c][k] += local[c][k];
+	}
+
+private:
+	const cv::Mat &src;
+	int method;
+	unsigned int (*hist)[NORMALIZATION_KEYS];
+	cv::Mutex &mutex;
+};
+
+// Maps the keys of a range of rows through the lookup tables. dst may be the same image as src.
+class NormalizationApply : public cv::ParallelLoopBody
+{
+public:
+	NormalizationApply(const cv::Mat &src, cv::Mat &dst, int method, const uchar (*lut)[NORMALIZATION_KEYS])
+	: src(src), dst(dst), method(method), lut(lut) {}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		int k0, k1, k2;
+		for (int i = range.start; i < range.end; i++)
+		{
+			const uchar* s = src.ptr<uchar>(i);
+			uchar* d = dst.ptr<uchar>(i);
+			for (int j = 0; j < src.cols*3; j += 3)
+			{
+				normalizationKeys(s + j, method, k0, k1, k2);
+				d[j] = lut[0][k0];
+				d[j+1] = lut[1][k1];
+				d[j+2] = lut[2][k2];
+			}
+		}
+	}
+
+private:
+	const cv::Mat &src;
+	cv::Mat &dst;
+	int method;
+	const uchar (*lut)[NORMALIZATION_KEYS];
+};
+
+// Builds the lookup tables from the key histograms. The values follow the same double precision
+// operations as the per-channel scaling and normalize(NORM_MINMAX) of the original implementation,
+// so the 8-bit result is the one of the original, not only of the buffer-reusing version.
+static void normalizationTables(const unsigned int (*hist)[NORMALIZATION_KEYS], int method, int pixels,
+		uchar (*lut)[NORMALIZATION_KEYS])
+{
+	for (int c = 0; c < 3; c++)
+	{
+		int kmin = NORMALIZATION_KEYS, kmax = -1;
+		double sum = 0;
+		for (int k = 0; k < NORMALIZATION_KEYS; k++)
+		{
+			if (hist[c][k] == 0)
+				continue;
+			kmin = min(kmin, k);
+			kmax = k;
+			sum += (double)k*hist[c][k];
+		}
+		std::fill(lut[c], lut[c] + NORMALIZATION_KEYS, 0);
+		// an empty channel is divided by a zero sum, which leaves zeros
+		if (kmax < 0 || (method != OPPONENT_AXIS && sum == 0))
+			continue;
+
+		bool negate = (method == OPPONENT_AXIS && c == 0);
+		// The baseline divided the channels by their sum, channel / sum. OpenCV evaluates a Mat
+		// divided by a scalar as a scaling by the reciprocal, channel*(1./sum), so the factor is
+		// the reciprocal and not a division per key, which would round differently.
+		double factor = 1.;
+		if (method == CHANNEL_WISE)
+			factor = 1./sum;
+		else
+			if (method == COMPREHENSIVE)
+				factor = 1./(sum*(3./pixels));
+
+		double smin = negate ? -(double)kmax : kmin*factor;
+		double smax = negate ? -(double)kmin : kmax*factor;
+		double scale = 255.*(smax - smin > DBL_EPSILON ? 1./(smax - smin) : 0);
+		double shift = 0 - smin*scale;
+		for (int k = 0; k < NORMALIZATION_KEYS; k++)
+		{
+			double value = negate ? -(double)k : k*factor;
+			lut[c][k] = saturate_cast<uchar>(value*scale + shift);
+		}
+	}
+}
+
+// Accumulates a 256-bin histogram of all the elements of a range of rows of an 8-bit image
+class ByteHistogram : public cv::ParallelLoopBody
+{
+public:
+	ByteHistogram(const cv::Mat &src, unsigned int *hist, cv::Mutex &mutex)
+	: src(src), hist(hist), mutex(mutex) {}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		unsigned int local[256] = {};
+		int width = src.cols*src.channels();
+		for (int i = range.start; i < range.end; i++)
+		{
+			const uchar* s = src.ptr<uchar>(i);
+			for (int j = 0; j < width; j++)
+				local[s[j]]++;
+		}
+		cv::AutoLock lock(mutex);
+		for (int v = 0; v < 256; v++)
+			hist[v] += local[v];
+	}
+
+private:
+	const cv::Mat &src;
+	unsigned int *hist;
+	cv::Mutex &mutex;
+};
+
+// Thresholds a range of rows of an 8-bit image and accumulates their 256-bin histogram
+class ThresholdAccumulate : public cv::ParallelLoopBody
+{
+public:
+	ThresholdAccumulate(const cv::Mat &src, cv::Mat &dst, int level, unsigned int *hist, cv::Mutex &mutex)
+	: src(src), dst(dst), level(level), hist(hist), mutex(mutex) {}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		unsigned int local[256] = {};
+		int width = src.cols*src.channels();
+		for (int i = range.start; i < range.end; i++)
+		{
+			const uchar* s = src.ptr<uchar>(i);
+			uchar* d = dst.ptr<uchar>(i);
+			for (int j = 0; j < width; j++)
+			{
+				local[s[j]]++;
+				d[j] = (s[j] > level) ? 255 : 0;
+			}
+		}
+		cv::AutoLock lock(mutex);
+		for (int v = 0; v < 256; v++)
+			hist[v] += local[v];
+	}
+
+private:
+	const cv::Mat &src;
+	cv::Mat &dst;
+	int level;
+	unsigned int *hist;
+	cv::Mutex &mutex;
+};
+
+// Value of the element with the given rank (0 is the smallest) from a 256-bin histogram
+static int histogramRank(const unsigned int *hist, int rank)
+{
+	unsigned int count = 0;
+	for (int v = 0; v < 256; v++)
+	{
+		count += hist[v];
+		if (count > (unsigned int)rank)
+			return v;
+	}
+	return 255;
+}
+
+// Value at the given percentile of all the elements of map, interpolated between the two closest
+// ranks the same way as reading them from the sorted map. 8-bit maps are ranked with a histogram
+// and other maps with a partial sort in buffer. Ranks outside the map are clamped to it.
+static float percentileValue(const cv::Mat &map, double percentile, cv::Mat &buffer)
+{
+	float ip, fPart, kPart, h, g;
+	int n = map.rows*map.cols*map.channels();
+	if (n == 0)
+		return 0.f;
+	ip = (percentile/100)*(n+1);//(percentile*n)/100 + 0.5;
+	fPart = modf(ip, &kPart);
+	int lo = min(max((int)kPart - 1, 0), n - 1);
+	int hi = min(max((int)kPart, 0), n - 1);
+
+	if (map.depth() == CV_8U)
+	{
+		unsigned int hist[256] = {};
+		cv::Mutex mutex;
+		parallel_for_(Range(0, map.rows), ByteHistogram(map, hist, mutex));
+		h = histogramRank(hist, lo);
+		g = histogramRank(hist, hi);
+	}else
+	{
+		map.convertTo(buffer, CV_32F);
+		float* values = buffer.ptr<float>();
+		std::nth_element(values, values + lo, values + n);
+		h = values[lo];
+		g = (hi > lo) ? *std::min_element(values + hi, values + n) : h;
+	}
+	return (1 - fPart)*h + fPart*g;
+}
+
+//****************************** AllocationCounter ******************************
+thread_local std::atomic<size_t> *AllocationCounter::counter = NULL;
+
+AllocationCounter::Scope::Scope(std::atomic<size_t> &total)
+{
+	previous = counter;
+	counter = &total;
+}
+AllocationCounter::Scope::~Scope()
+{
+	counter = previous;
+}
+// The default allocator is a global of OpenCV that is read without a lock, so it is only set once
+void AllocationCounter::install()
+{
+	static AllocationCounter instance;
+	if (Mat::getDefaultAllocator() != &instance)
+		Mat::setDefaultAllocator(&instance);
+}
+// Buffers wrapping user data are not allocations and are only passed on
+cv::UMatData* AllocationCounter::allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+		AccessFlags flags, cv::UMatUsageFlags usageFlags) const
+{
+	if (!data && counter)
+		(*counter)++;
+	return Mat::getStdAllocator()->allocate(dims, sizes, type, data, step, flags, usageFlags);
+}
+bool AllocationCounter::allocate(cv::UMatData* data, AccessFlags accessFlags, cv::UMatUsageFlags usageFlags) const
+{
+	return Mat::getStdAllocator()->allocate(data, accessFlags, usageFlags);
+}
+void AllocationCounter::deallocate(cv::UMatData* data) const
+{
+	Mat::getStdAllocator()->deallocate(data);
+}
+
+//****************************** PercentileTracker ******************************
+PercentileTracker::PercentileTracker(double decay)
+{
+	this->decay = decay;
+	reset();
+}
+void PercentileTracker::reset()
+{
+	std::fill(counts, counts + 256, 0.);
+	total = 0;
+}
+// Scales down the counts of the previous frames
+void PercentileTracker::forget()
+{
+	for (int v = 0; v < 256; v++)
+		counts[v] *= decay;
+	total *= decay;
+}
+// Adds the elements of a map, or of one tile of it, to the current frame
+void PercentileTracker::accumulate(const cv::Mat &map)
+{
+	CV_Assert(map.depth() == CV_8U);
+	unsigned int hist[256] = {};
+	cv::Mutex mutex;
+	parallel_for_(Range(0, map.rows), ByteHistogram(map, hist, mutex));
+	for (int v = 0; v < 256; v++)
+	{
+		counts[v] += hist[v];
+		total += hist[v];
+	}
+}
+// Thresholds a map as percentileThreshold does, with the percentile of the previous frames, and
+// adds the map to them in the same pass. The first frame has no history and uses its own percentile.
+void PercentileTracker::threshold(const cv::Mat &map, cv::Mat &binary, double percent)
+{
+	CV_Assert(map.depth() == CV_8U);
+	if (total <= 0)
+	{
+		accumulate(map);
+		cv::threshold(map, binary, (double)percentile(percent), 255, THRESH_BINARY);
+		return;
+	}
+	// an 8-bit threshold keeps the values above the floor of the percentile
+	int level = cvFloor(percentile(percent));
+	forget();
+	unsigned int hist[256] = {};
+	cv::Mutex mutex;
+	binary.create(map.size(), map.type());
+	parallel_for_(Range(0, map.rows), ThresholdAccumulate(map, binary, level, hist, mutex));
+	for (int v = 0; v < 256; v++)
+	{
+		counts[v] += hist[v];
+		total += hist[v];
+	}
+}
+void PercentileTracker::merge(const PercentileTracker &other)
+{
+	for (int v = 0; v < 256; v++)
+		counts[v] += other.counts[v];
+	total += other.total;
+}
+// Value with the given weighted rank, 0 being the smallest element
+int PercentileTracker::rank(double r) const
+{
+	double count = 0;
+	int last = 0;
+	for (int v = 0; v < 256; v++)
+	{
+		if (counts[v] <= 0)
+			continue;
+		count += counts[v];
+		last = v;
+		if (count > r)
+			return v;
+	}
+	return last;
+}
+// Same interpolation between ranks as percentileThreshold, using the weighted counts
+float PercentileTracker::percentile(double percent) const
+{
+	if (total <= 0)
+		return 0.f;
+	double ip = (percent/100)*(total+1);
+	double kPart = floor(ip);
+	double fPart = ip - kPart;
+	int h = rank(min(max(kPart - 1, 0.), total - 1));
+	int g = rank(min(max(kPart, 0.), total - 1));
+	return (float)((1 - fPart)*h + fPart*g);
+}
+
 Attention::Attention()
 {
 	_colors =  vector<string>{"RGB", "HSV", "Lab", "Luv", "HSI", "HSL", "CMY", "C1C2C3", "COPP", "YCrCb", "YIQ", "XYZ", "UVW", "YUV",
 		"OPP", "NOPP", "xyY", "rg", "YES", "I1I2I3"};
 	counter = 0;
+	streamingPercentile = false;
+	num_kernels = 0;
+	kernels = NULL;
+	aim_temp = NULL;
+	data = NULL;
 };
 Attention::~Attention(){
+	releaseBasis();
+};
+//Releases the basis loaded for AIM
+void Attention::releaseBasis()
+{
 	for (int i = 0; i < num_kernels; i++) {
 		delete [] kernels[i];
 	}
 	delete [] kernels;
 	delete [] aim_temp;
 	delete [] data;
-};
+	num_kernels = 0;
+	kernels = NULL;
+	aim_temp = NULL;
+	data = NULL;
+	basisFile.clear();
+}
 
 //****************************** Utilities ******************************
 //Normalizes the input image. There are 4 different methods of normalization
 //PIXEL_WISE, CHANNEL_WISE, OPPONENT_AXIS, COMPREHENSIVE
+//PIXEL_WISE_LUT gives the same result as PIXEL_WISE using integer reciprocals
 cv::Mat Attention::normalizeImage(cv::Mat RGBImage , int method )
 {
-	Mat rgbImg = RGBImage.clone();
-
-	if (method == PIXEL_WISE){
-
-		double intensity = 0.;
-		double nR = 0.;
-		double nG = 0.;
-		double nB = 0.;
-
-		for (int i = 0; i < rgbImg.rows; i++){
-			for (int j = 0; j < rgbImg.cols ; j++){
-				intensity = rgbImg.at<Vec3b>(i,j)[0] + rgbImg.at<Vec3b>(i,j)[1] + rgbImg.at<Vec3b>(i,j)[2];
-				if (intensity == 0.){
-					intensity = 1/sqrt((double)3);
-				}
-				nB = rgbImg.at<Vec3b>(i,j)[0]/intensity;
-				nG = rgbImg.at<Vec3b>(i,j)[1]/intensity;
-				nR = rgbImg.at<Vec3b>(i,j)[2]/intensity;
-				rgbImg.at<Vec3b>(i,j)[0] = floor(nB*255);
-				rgbImg.at<Vec3b>(i,j)[1] = floor(nG*255);
-				rgbImg.at<Vec3b>(i,j)[2] = floor(nR*255);
-			}
-		}
+	Mat rgbImg;
+	normalizeImage(RGBImage, rgbImg, method);
+	return rgbImg;
+}
 
-		return rgbImg;
+// Same as above but writes into output, which is reused when its size and type match.
+// output may be the input image.
+void Attention::normalizeImage(const cv::Mat &RGBImage, cv::Mat &output, int method)
+{
+	if (method == PIXEL_WISE || method == PIXEL_WISE_LUT){
+		static const PixelWiseTable table;
+		output.create(RGBImage.rows, RGBImage.cols, CV_8UC3);
+		parallel_for_(Range(0, RGBImage.rows),
+				PixelWiseNormalizer(RGBImage, output, method == PIXEL_WISE_LUT ? table.recip : NULL));
 	}else
-		if(method == CHANNEL_WISE){
-			rgbImg.convertTo(rgbImg, CV_64F);
-			vector<Mat> RGBChannel;
-			split(rgbImg,RGBChannel);
-			Scalar sumChannels = sum(rgbImg);
-			RGBChannel[2] = RGBChannel[2] / sumChannels[2];
-			RGBChannel[1] = RGBChannel[1] / sumChannels[1];
-			RGBChannel[0] = RGBChannel[0] / sumChannels[0];
-
-			normalize(RGBChannel[2] , RGBChannel[2] , 255, 0, NORM_MINMAX, -1, noArray());
-			normalize(RGBChannel[1] , RGBChannel[1] , 255, 0, NORM_MINMAX, -1, noArray());
-			normalize(RGBChannel[0] , RGBChannel[0] , 255, 0, NORM_MINMAX, -1, noArray());
-			merge(RGBChannel, rgbImg);
-			rgbImg.convertTo(rgbImg, CV_8U);
-			return rgbImg;
+		if (method == CHANNEL_WISE || method == OPPONENT_AXIS || method == COMPREHENSIVE){
+			unsigned int hist[3][NORMALIZATION_KEYS] = {};
+			uchar lut[3][NORMALIZATION_KEYS];
+			cv::Mutex mutex;
+			parallel_for_(Range(0, RGBImage.rows), NormalizationHistogram(RGBImage, method, hist, mutex));
+			normalizationTables(hist, method, RGBImage.rows*RGBImage.cols, lut);
+			output.create(RGBImage.rows, RGBImage.cols, CV_8UC3);
+			parallel_for_(Range(0, RGBImage.rows), NormalizationApply(RGBImage, output, method, lut));
 		}else
-			if (method == OPPONENT_AXIS){
-				Mat rgbImg = RGBImage.clone();
-				rgbImg.convertTo(rgbImg, CV_64F);
-				vector<Mat> RGBChannel;
-				split(rgbImg,RGBChannel);
-				vector<Mat> tempRGB = RGBChannel;
-				tempRGB[2] = RGBChannel[2] + RGBChannel[1] + RGBChannel[0];
-				tempRGB[1] = RGBChannel[2] - RGBChannel[1];
-				tempRGB[0] = 2* RGBChannel[0] - RGBChannel[2] - RGBChannel[1] ;
-
-				normalize(tempRGB[2] , tempRGB[2] , 255, 0, NORM_MINMAX, -1, noArray());
-				normalize(tempRGB[1] , tempRGB[1] , 255, 0, NORM_MINMAX, -1, noArray());
-				normalize(tempRGB[0] , tempRGB[0] , 255, 0, NORM_MINMAX, -1, noArray());
-				merge(tempRGB, rgbImg);
-				rgbImg.convertTo(rgbImg, CV_8U);
-				return rgbImg;
-			}else
-				if (method == COMPREHENSIVE){
-
-					double intensity = 0.;
-					double nR = 0.;
-					double nG = 0.;
-					double nB = 0.;
-
-					for (int i = 0; i < rgbImg.rows; i++){
-						for (int j = 0; j < rgbImg.cols ; j++){
-							intensity = rgbImg.at<Vec3b>(i,j)[0] + rgbImg.at<Vec3b>(i,j)[1] + rgbImg.at<Vec3b>(i,j)[2];
-							if (intensity == 0.){
-								intensity = 1/sqrt((double)3);
-							}
-							nB = rgbImg.at<Vec3b>(i,j)[0]/intensity;
-							nG = rgbImg.at<Vec3b>(i,j)[1]/intensity;
-							nR = rgbImg.at<Vec3b>(i,j)[2]/intensity;
-							rgbImg.at<Vec3b>(i,j)[0] = floor(nB);
-							rgbImg.at<Vec3b>(i,j)[1] = floor(nG);
-							rgbImg.at<Vec3b>(i,j)[2] = floor(nR);
-						}
-					}
-
-					rgbImg.convertTo(rgbImg, CV_64F);
-					vector<Mat> RGBChannel;
-					split(rgbImg,RGBChannel);
-					double normCoef = 3./(rgbImg.size[0]*rgbImg.size[1]);
-					std:: cout << "coef: " << normCoef << "\n";
-					Scalar sumChannels = sum(rgbImg);
-					RGBChannel[2] = RGBChannel[2] / (sumChannels[2]*normCoef);
-					RGBChannel[1] = RGBChannel[1] / (sumChannels[1]*normCoef);
-					RGBChannel[0] = RGBChannel[0] / (sumChannels[0]*normCoef);
-
-					normalize(RGBChannel[2] , RGBChannel[2] , 255, 0, NORM_MINMAX, -1, noArray());
-					normalize(RGBChannel[1] , RGBChannel[1] , 255, 0, NORM_MINMAX, -1, noArray());
-					normalize(RGBChannel[0] , RGBChannel[0] , 255, 0, NORM_MINMAX, -1, noArray());
-					merge(RGBChannel, rgbImg);
-					std:: cout << "converted\n";
-					rgbImg.convertTo(rgbImg, CV_8U);
-					return rgbImg;
-				}else
-				{
-					std::cout << " Wrong method is selected for Normalization \n";
-					return RGBImage;
-				}
+		{
+			std::cout << " Wrong method is selected for Normalization \n";
+			RGBImage.copyTo(output);
+		}
 }
 
 // Normalizes the input histogram
@@ -153,20 +658,14 @@ void Attention::normalizeHistogram(cv::Mat &histogram)
 cv::Mat Attention::percentileThreshold(cv::Mat salMap, double percentile)
 {
 	Mat salMapBinary;
-	Mat map = salMap.clone();
-	Mat vectorizedMap = map.reshape(1,1);
-	cv::sort(vectorizedMap , vectorizedMap , CV_SORT_ASCENDING);
-	float ip, xInt, fPart, kPart;
-	int n = vectorizedMap.cols;
-	ip = (percentile/100)*(n+1);//(percentile*n)/100 + 0.5;
-	fPart = modf(ip, &kPart);
-	int h = (int)vectorizedMap.at<uchar>(0, kPart-1);
-	int g = (int)vectorizedMap.at<uchar>(0, kPart);
-	xInt = (1 - fPart)*h +fPart *g;
-	threshold(salMap, salMapBinary, (double)xInt, 255, THRESH_BINARY);
-
+	percentileThreshold(salMap, salMapBinary, percentile);
 	return salMapBinary;
 }
+void Attention::percentileThreshold(const cv::Mat &salMap, cv::Mat &salMapBinary, double percentile)
+{
+	float xInt = percentileValue(salMap, percentile, percentileBuffer);
+	threshold(salMap, salMapBinary, (double)xInt, 255, THRESH_BINARY);
+}
 void Attention::rotation2D(double &y, double &x, double angle)
 {
 	double rad =  angle * PI/180;
@@ -179,124 +678,101 @@ void Attention::rotation2D(double &y, double &x, double angle)
 //Converts the input image to one of the spaces in colorSpace
 cv::Mat Attention::imageConversion(cv::Mat inputImg, colorSpace type, bool norm)
 {
+	ConversionWorkspace ws;
 	Mat output;
-	vector<Mat> channels, HSIChannels, CMYChannels(3), C1C2C3Channels(3),
-			O1O2Channels(2), YIQChannels(3), UVWChannels(3), YUVChannels(3),
-			xyYChannels(3), OPPChannels(3), rgChannels(2), YESChannels(3), I3Channels(3);
-	Mat t, I, S, scaledImage, onesMat;
-	Mat Y, C, C1, C2, H, O3;
-	vector<double> mean, dev;
-	int index = type;
-
-	inputImg.convertTo(scaledImage, CV_32FC3);
-	scaledImage *= 1.f/255.f;
-	//cout << "Convert To color space: " << models[index] << "\n";
+	imageConversion(inputImg, output, type, ws, norm);
+	return output;
+}
+
+// Same as above but writes into output and keeps all temporaries in ws, so repeated calls
+// with images of the same size do not allocate. output may be the input image.
+void Attention::imageConversion(const cv::Mat &inputImg, cv::Mat &output, colorSpace type, ConversionWorkspace &ws, bool norm)
+{
+	if (type == colorSpace::RGB || type < colorSpace::RGB || type > colorSpace::I1I2I3)
+	{
+		inputImg.convertTo(output, CV_32FC3, 1.f/255.f);
+		return;
+	}
+
+	inputImg.convertTo(ws.scaled, CV_32FC3, 1.f/255.f);
+	const Mat &scaledImage = ws.scaled;
+	int rows = scaledImage.rows, cols = scaledImage.cols;
 
 	switch (type){
 	//******************* HSV****************
 	case colorSpace::HSV:
-		cvtColor(scaledImage, output, CV_BGR2HSV);
-
 		if (norm){
-			split(output, channels);
-			channels[0]/=360;
-			merge(channels,output);
+			const float hsv[3][4] = {{1.f/360.f, 0, 0, 0}, {0, 1.f, 0, 0}, {0, 0, 1.f, 0}};
+			cvtColor(scaledImage, ws.converted, CV_BGR2HSV);
+			transform(ws.converted, output, Mat(3, 4, CV_32F, (void*)hsv));
+		}else
+		{
+			cvtColor(scaledImage, output, CV_BGR2HSV);
 		}
-
 		break;
 
 		//******************* HSL****************
 	case colorSpace::HSL:
-		cvtColor(scaledImage, output, CV_BGR2HLS);
-		split(output, channels);
-		t = channels[1].clone();
-		channels[1] = channels[2].clone();
-		channels[2] = t.clone();
-
-		if(norm){
-			channels[0]/=360;
-		}
-
-		merge(channels, output);
+	{
+		// HLS to HSL is a channel swap
+		float hue = norm ? 1.f/360.f : 1.f;
+		const float hsl[3][4] = {{hue, 0, 0, 0}, {0, 0, 1.f, 0}, {0, 1.f, 0, 0}};
+		cvtColor(scaledImage, ws.converted, CV_BGR2HLS);
+		transform(ws.converted, output, Mat(3, 4, CV_32F, (void*)hsl));
 		break;
+	}
 
 		//******************* HSI****************
 	case colorSpace::HSI:
-		cvtColor(scaledImage, t, CV_BGR2HLS);
-		split(scaledImage, channels);
-
-		I = 1.f/3.f * (channels[0] + channels[1]+ channels[2]);
-		S = Mat(channels[0].rows, channels[0].cols, CV_32F); // s in [0,1]
-		//.ptr<t>(rows)[cols*3]
-		//.ptr<t>(i)[j*3+1]
-		//.ptr<t>(i)[j*3+2]
-		for (int i = 0; i < S.rows; i++)
-			for(int j = 0; j< S.cols; j++)
-			{
-				float r = channels[2].at<float>(i,j);
-				float g = channels[1].at<float>(i,j);
-				float b = channels[0].at<float>(i,j);
-
-				if (max(g,max(r,b)) != 0)
-				{
-					S.at<float>(i,j) = 1 - min(g,min(r,b))/I.at<float>(i,j);
-
-				}else
-				{
-					S.at<float>(i,j) = 0.f;
-				}
-			}
-
-		split(t, HSIChannels);
-		HSIChannels[1] = S;
-		HSIChannels[2] = I;
+	{
+		cvtColor(scaledImage, ws.converted, CV_BGR2HLS);
+		output.create(rows, cols, CV_32FC3);
+		float hue = norm ? 1.f/360.f : 1.f;
 
-		if(norm)
+		for (int i = 0; i < rows; i++)
 		{
-			HSIChannels[0]/=360.f;
+			const float* bgr = scaledImage.ptr<float>(i);
+			const float* hls = ws.converted.ptr<float>(i);
+			float* hsi = output.ptr<float>(i);
+			for(int j = 0; j < cols*3; j += 3)
+			{
+				float b = bgr[j];
+				float g = bgr[j+1];
+				float r = bgr[j+2];
+				float I = 1.f/3.f * (b + g + r);
+
+				hsi[j] = hls[j]*hue;
+				hsi[j+1] = (max(g,max(r,b)) != 0) ? 1 - min(g,min(r,b))/I : 0.f; // s in [0,1]
+				hsi[j+2] = I;
+			}
 		}
-
-		merge(HSIChannels, output);
-		break;
-
-		//******************* CMY****************
-	case colorSpace::CMY:
-		split(scaledImage, channels);
-		onesMat = Mat(scaledImage.rows, scaledImage.cols,CV_32F, Scalar::all(1));
-		CMYChannels[0] = onesMat - channels[2];
-		CMYChannels[1] = onesMat - channels[1];
-		CMYChannels[2] = onesMat - channels[0];
-		merge(CMYChannels, output);
 		break;
+	}
 
 		//******************* Lab****************
 	case colorSpace::Lab:
-		cvtColor(scaledImage , output , CV_BGR2Lab);
-
 		if (norm)
 		{
-			split(output, channels);
-			channels[0]/=100.f;
-			channels[1] = (channels[1] + 127.f)/254.f;
-			channels[2] = (channels[2] + 127.f)/254.f;
-			merge(channels, output);
+			const float lab[3][4] = {{1.f/100.f, 0, 0, 0}, {0, 1.f/254.f, 0, 127.f/254.f}, {0, 0, 1.f/254.f, 127.f/254.f}};
+			cvtColor(scaledImage , ws.converted , CV_BGR2Lab);
+			transform(ws.converted, output, Mat(3, 4, CV_32F, (void*)lab));
+		}else
+		{
+			cvtColor(scaledImage , output , CV_BGR2Lab);
 		}
-
 		break;
 
 		//******************* Luv ****************
 	case colorSpace::Luv:
-		cvtColor(scaledImage , output , CV_BGR2Luv);
-
 		if (norm)
 		{
-			split(output, channels);
-			channels[0]/=100.f;
-			channels[1] = (channels[1] + 134.f)/354.f;
-			channels[2] = (channels[2] + 140.f)/262.f;
-			merge(channels, output);
+			const float luv[3][4] = {{1.f/100.f, 0, 0, 0}, {0, 1.f/354.f, 0, 134.f/354.f}, {0, 0, 1.f/262.f, 140.f/262.f}};
+			cvtColor(scaledImage , ws.converted , CV_BGR2Luv);
+			transform(ws.converted, output, Mat(3, 4, CV_32F, (void*)luv));
+		}else
+		{
+			cvtColor(scaledImage , output , CV_BGR2Luv);
 		}
-
 		break;
 
 		//******************* YCrCb ****************
@@ -306,199 +782,110 @@ cv::Mat Attention::imageConversion(cv::Mat inputImg, colorSpace type, bool norm)
 
 		//******************* C1C2C3 ****************
 	case colorSpace::C1C2C3:
-		split(scaledImage, channels);
-		C1C2C3Channels[0] = Mat(scaledImage.rows, scaledImage.cols,CV_32F);
-		C1C2C3Channels[1] = Mat(scaledImage.rows, scaledImage.cols,CV_32F);
-		C1C2C3Channels[2] = Mat(scaledImage.rows, scaledImage.cols,CV_32F);
-
-		for (int i = 0; i < scaledImage.rows; i++)
-			for(int j = 0; j < scaledImage.cols; j++)
-			{
-				float r = channels[2].at<float>(i,j);
-				float g = channels[1].at<float>(i,j);
-				float b = channels[0].at<float>(i,j);
-
-				C1C2C3Channels[0].at<float>(i,j) = atan2(r,max(g,b));
-				C1C2C3Channels[1].at<float>(i,j) = atan2(g,max(r,b));
-				C1C2C3Channels[2].at<float>(i,j) = atan2(b,max(g,r));
-			}
-
-		if (norm)
-		{
-			C1C2C3Channels[0] = (C1C2C3Channels[0]+PI/2.f)/PI;
-			C1C2C3Channels[1] = (C1C2C3Channels[1]+PI/2.f)/PI;
-			C1C2C3Channels[2] = (C1C2C3Channels[2]+PI/2.f)/PI;
-		}
-
-		merge(C1C2C3Channels, output);
-		break;
-
-		//******************* COPP ****************
-	case colorSpace::COPP:
-		split(scaledImage, channels);
-		O1O2Channels[0] = (channels[2]-channels[1])/sqrt(2.f);
-		O1O2Channels[1] = (channels[2]+channels[1]-2.f*channels[0])/sqrt(6.f);
+		output.create(rows, cols, CV_32FC3);
 
-		if (norm)
+		for (int i = 0; i < rows; i++)
 		{
-			float denom = 1.f/sqrt(2.f);
-			float denom2 = 2.f/sqrt(6.f);
-			O1O2Channels[0] = (O1O2Channels[0]+denom )/(denom*2.f);
-			threshold( O1O2Channels[0], O1O2Channels[0], 0, 0,THRESH_TOZERO);
-
-			O1O2Channels[1] = (O1O2Channels[1]+denom2 )/(denom2*2.f);
-			threshold( O1O2Channels[1], O1O2Channels[1], 0, 0,THRESH_TOZERO);
-		}
-
-		merge(O1O2Channels, output);
-		break;
-
-		//******************* XYZ ****************
-	case colorSpace::XYZ:
-		cvtColor(scaledImage , output , CV_BGR2XYZ);
-
-		if (norm)
-		{
-			split(output, channels);
-			channels[0] /= 0.950456f;
-			channels[2] /= 1.088754f ;
-			merge(channels, output);
-		}
-
-		break;
-
-		//******************* YIQ ****************
-	case colorSpace::YIQ:
-		split(scaledImage, channels);
-		YIQChannels[0] = 0.299f*channels[2] + 0.587f*channels[1] + 0.114f*channels[0];
-		YIQChannels[1] = 0.596f*channels[2] - 0.274f*channels[1] - 0.322f*channels[0];
-		YIQChannels[2] = 0.211f*channels[2] - 0.523f*channels[1] - 0.312f*channels[0];
-
-		if (norm)
-		{
-			YIQChannels[1]  = (YIQChannels[1] + 0.596f)/(1.192f);
-			YIQChannels[2]  = (YIQChannels[2] + 0.835f)/(1.046f);
-		}
-
-		merge(YIQChannels, output);
-		break;
-
-		//*******************  UVW ****************
-	case colorSpace::UVW:
-		cvtColor(scaledImage , t , CV_BGR2XYZ);
-		split(t, channels);
-		UVWChannels[0] = 0.66f*channels[0];
-		UVWChannels[1] = channels[1];
-		UVWChannels[2] = -0.5f*channels[0] + 1.5f*channels[1] + 0.5f*channels[2];
-
-		if (norm)
-		{
-			UVWChannels[0] /= 0.66f;
-			UVWChannels[2] /= 1.569149f;
-		}
-
-		merge(UVWChannels, output);
-		break;
-		//******************* YUV ****************
-	case colorSpace::YUV:
-		split(scaledImage, channels);
-		YUVChannels[0] = 0.299f*channels[2] + 0.587f*channels[1] + 0.114f*channels[0];
-		YUVChannels[1] = 0.492f*(channels[0]-YUVChannels[0]);
-		YUVChannels[2] = 0.77f*(channels[2]-YUVChannels[0]);
-
-		if (norm)
-		{
-			YUVChannels[1]  = (YUVChannels[1] + 0.435912f)/(0.871824f);
-			YUVChannels[2]  = (YUVChannels[2] + 0.53977f)/(1.07954f);
-		}
-
-		merge(YUVChannels, output);
-		break;
+			const float* bgr = scaledImage.ptr<float>(i);
+			float* c = output.ptr<float>(i);
+			for(int j = 0; j < cols*3; j += 3)
+			{
+				float b = bgr[j];
+				float g = bgr[j+1];
+				float r = bgr[j+2];
 
-		//******************* OPP ****************
-	case colorSpace::OPP:
-		split(scaledImage, channels);
-		OPPChannels[0] = (channels[2] - channels[1])/sqrt(2.f);
-		OPPChannels[1] = (channels[2] + channels[1]-2.f*channels[0])/sqrt(6.f);
-		OPPChannels[2] = (channels[0] + channels[1]+channels[2])/sqrt(3.f);
+				c[j] = atan2(r,max(g,b));
+				c[j+1] = atan2(g,max(r,b));
+				c[j+2] = atan2(b,max(g,r));
 
-		if (norm)
-		{
-			float denom = 1.f/sqrt(2.f);
-			float denom2 = 2.f/sqrt(6.f);
-			OPPChannels[0] = (OPPChannels[0]+denom )/(denom*2.f);
-			threshold(OPPChannels[0],OPPChannels[0], 0, 0,THRESH_TOZERO);
-			OPPChannels[1] = (OPPChannels[1]+denom2 )/(denom2*2.f);
-			threshold(OPPChannels[1],OPPChannels[1], 0, 0,THRESH_TOZERO);
-			OPPChannels[2] /= 1.f/sqrt(3.f);
+				if (norm)
+				{
+					c[j] = (c[j]+PI/2.f)/PI;
+					c[j+1] = (c[j+1]+PI/2.f)/PI;
+					c[j+2] = (c[j+2]+PI/2.f)/PI;
+				}
+			}
 		}
-
-		merge(OPPChannels, output);
 		break;
 
 		//******************* NOPP ****************
 	case colorSpace::NOPP:
-		split(scaledImage, channels);
-		O3 = (channels[0] + channels[1] + channels[2])/sqrt(3.f);
-		O1O2Channels[0] = (channels[2]-channels[1])/sqrt(2.f);
-		divide(O1O2Channels[0], O3,O1O2Channels[0]);
-		O1O2Channels[1] = (channels[2]+channels[1]-2.f*channels[0])/sqrt(6.f);
-		divide(O1O2Channels[1], O3 ,O1O2Channels[1]);
+	{
+		float denom1_1 = sqrt(3.f)/(sqrt(2.f));
+		float denom1_2 = denom1_1*2.f;
+		float denom2_1 = 2.f*sqrt(3.f)/sqrt(6.f);
+		float denom2_2 =  denom2_1 + sqrt(3.f)/sqrt(6.f);
+		output.create(rows, cols, CV_32FC2);
 
-		if (norm)
+		for (int i = 0; i < rows; i++)
 		{
-			float denom1_1 = sqrt(3.f)/(sqrt(2.f));
-			float denom1_2 = denom1_1*2.f;
-			float denom2_1 = 2.f*sqrt(3.f)/sqrt(6.f);
-			float denom2_2 =  denom2_1 + sqrt(3.f)/sqrt(6.f);
-
-			O1O2Channels[0] = (O1O2Channels[0] + denom1_1) / denom1_2;
-			threshold(O1O2Channels[0],O1O2Channels[0], 0, 0,THRESH_TOZERO);
-			O1O2Channels[1] = (O1O2Channels[1] + denom2_1) / denom2_2;
-			threshold(O1O2Channels[1],O1O2Channels[1], 0, 0,THRESH_TOZERO);
+			const float* bgr = scaledImage.ptr<float>(i);
+			float* o = output.ptr<float>(i);
+			for(int j = 0; j < cols; j++)
+			{
+				float b = bgr[j*3];
+				float g = bgr[j*3+1];
+				float r = bgr[j*3+2];
+				float O3 = (b + g + r)/sqrt(3.f);
+				float O1 = (r - g)/sqrt(2.f);
+				float O2 = (r + g - 2.f*b)/sqrt(6.f);
+				O1 = (O3 != 0) ? O1/O3 : 0.f;
+				O2 = (O3 != 0) ? O2/O3 : 0.f;
+
+				if (norm)
+				{
+					O1 = (O1 + denom1_1) / denom1_2;
+					O2 = (O2 + denom2_1) / denom2_2;
+					O1 = (O1 > 0) ? O1 : 0.f;
+					O2 = (O2 > 0) ? O2 : 0.f;
+				}
+				o[j*2] = O1;
+				o[j*2+1] = O2;
+			}
 		}
-
-		merge(O1O2Channels, output);
 		break;
+	}
 
 		//******************* xyY ****************
 	case colorSpace::xyY:
-		cvtColor(scaledImage , t , CV_BGR2XYZ);
-		split(t, channels);
-		divide(channels[0],channels[0]+channels[1]+channels[2], xyYChannels[0]);
-		divide(channels[1],channels[0]+channels[1]+channels[2], xyYChannels[1]);
-		xyYChannels[2] = channels[1];
+		affineColorConversion(scaledImage, ws.converted, colorSpace::XYZ, false);
+		output.create(rows, cols, CV_32FC3);
 
-		if(norm)
+		for (int i = 0; i < rows; i++)
 		{
-			xyYChannels[0] = xyYChannels[0] / 0.639999814f ;
-			xyYChannels[1] = xyYChannels[1] / 0.6f;
-		}
+			const float* XYZ = ws.converted.ptr<float>(i);
+			float* xyY = output.ptr<float>(i);
+			for(int j = 0; j < cols*3; j += 3)
+			{
+				float s = XYZ[j] + XYZ[j+1] + XYZ[j+2];
+				xyY[j] = (s != 0) ? XYZ[j]/s : 0.f;
+				xyY[j+1] = (s != 0) ? XYZ[j+1]/s : 0.f;
+				xyY[j+2] = XYZ[j+1];
 
-		merge(xyYChannels, output);
+				if(norm)
+				{
+					xyY[j] = xyY[j] / 0.639999814f;
+					xyY[j+1] = xyY[j+1] / 0.6f;
+				}
+			}
+		}
 		break;
 
 		//******************* rg ****************
 	case colorSpace::rg:
-		split(scaledImage, channels);
-		divide(channels[2],channels[0]+channels[1]+channels[2],rgChannels[0]);
-		divide(channels[1],channels[0]+channels[1]+channels[2],rgChannels[1]);
-		merge(rgChannels,output);
-		break;
+		output.create(rows, cols, CV_32FC2);
 
-		//******************* YES ****************
-	case colorSpace::YES:
-		split(scaledImage, channels);
-		YESChannels[0] = 0.253f*channels[2] + 0.684f*channels[1] + 0.063f*channels[0];
-		YESChannels[1] = 0.5f*channels[2] - 0.5f*channels[1];
-		YESChannels[2] = 0.250f*channels[2] + 0.250f*channels[1] - 0.5f*channels[0];
-		if(norm)
+		for (int i = 0; i < rows; i++)
 		{
-			YESChannels[1] += 0.5f;
-			YESChannels[2] += 0.5f;
+			const float* bgr = scaledImage.ptr<float>(i);
+			float* rg = output.ptr<float>(i);
+			for(int j = 0; j < cols; j++)
+			{
+				float s = bgr[j*3] + bgr[j*3+1] + bgr[j*3+2];
+				rg[j*2] = (s != 0) ? bgr[j*3+2]/s : 0.f;
+				rg[j*2+1] = (s != 0) ? bgr[j*3+1]/s : 0.f;
+			}
 		}
-
-		merge(YESChannels,output);
 		break;
 
 		//		//******************* TRGB ****************
@@ -512,75 +899,58 @@ cv::Mat Attention::imageConversion(cv::Mat inputImg, colorSpace type, bool norm)
 		//		merge(channels, output);
 		//		break;
 
-
-	case colorSpace::I1I2I3:
-		split(scaledImage, channels);
-
-		I3Channels[0] = (channels[0]+channels[1]+channels[2])/3.f;
-		I3Channels[1] = (channels[2] - channels[0])/2.f;
-		I3Channels[2] = (2*channels[1] - channels[2] -channels[0])/4.f;
-
-		if(norm)
-		{
-			I3Channels[1] += 0.5f;
-			I3Channels[2] += 0.5f;
-		}
-
-		merge(I3Channels, output);
-		break;
-
-	case colorSpace::RGB:
-		output = scaledImage.clone();
-		break;
-
+		//******************* CMY, COPP, XYZ, YIQ, UVW, YUV, OPP, YES, I1I2I3 ****************
 	default:
-		output = scaledImage.clone();
+		affineColorConversion(scaledImage, output, type, norm);
 		break;
-
-		return output;
 	}
 }
 
 
 //****************************** Methods ******************************
 cv::Mat Attention::getBackProj(cv::Mat imageInput, cv::Mat temp, std::string cSpace, bool normal, int bins, bool thresh)
+{
+	Mat backProjectedImage;
+	getBackProj(imageInput, temp, backProjectedImage, cSpace, normal, bins, thresh);
+	return backProjectedImage;
+}
+// Same as above but reuses the conversion buffers of this object between calls
+void Attention::getBackProj(const cv::Mat &imageInput, const cv::Mat &temp, cv::Mat &backProjectedImage,
+		std::string cSpace, bool normal, int bins, bool thresh)
 {
 	int channels [] = {0,1,2,3};
-	int dim = image.channels();
 	int histSize[] = {bins,bins,bins,bins};
 	float range[] = {0, 1};
 	const float* ranges[] = {range, range ,range,range};
 
-	Mat templateHistogram;
-
-	Mat image = imageInput.clone();
+	std::vector<string>::iterator it;
+	it = find (_colors.begin(), _colors.end(), cSpace);
+	colorSpace space = static_cast<colorSpace>(it - _colors.begin());
 
-	temp = normalizeImage(temp);
+	normalizeImage(temp, bpNormTemplate);
+	imageConversion(bpNormTemplate, bpTemplate, space, workspace);
 
 	if (normal)
 	{
-		image= normalizeImage(image);
+		normalizeImage(imageInput, bpNormImage);
+		imageConversion(bpNormImage, bpImage, space, workspace);
+	}else
+	{
+		imageConversion(imageInput, bpImage, space, workspace);
 	}
 
-	std::vector<string>::iterator it;
-	it = find (_colors.begin(), _colors.end(), cSpace);
-	int pos = it - _colors.begin();
-	image = imageConversion(image, static_cast<colorSpace>(pos));
-	temp  = imageConversion(temp , static_cast<colorSpace>(pos));
-
-	calcHist(&temp,1,channels,Mat(),templateHistogram, dim, histSize, ranges, true, false);
-	normalizeHistogram(templateHistogram);
+	// the histogram has one dimension per channel of the converted images. The image member
+	// belongs to AIM, it is empty before AIM runs and AIM may be writing it concurrently.
+	int dim = bpImage.channels();
+	calcHist(&bpTemplate,1,channels,Mat(),bpHistogram, dim, histSize, ranges, true, false);
+	normalizeHistogram(bpHistogram);
 
-	Mat backProjectedImage;
-	calcBackProject(&image, 1, channels, templateHistogram, backProjectedImage, ranges, 1, true );
+	calcBackProject(&bpImage, 1, channels, bpHistogram, bpProjection, ranges, 1, true );
 
 	if(thresh)
-		threshold(backProjectedImage, backProjectedImage, 0,255,THRESH_BINARY);
-
-	backProjectedImage.convertTo(backProjectedImage, CV_8UC1);
-
-	return backProjectedImage;
+		threshold(bpProjection, bpProjection, 0,255,THRESH_BINARY);
 
+	bpProjection.convertTo(backProjectedImage, CV_8UC1);
 }
 /* Load basis from a binary file
  * Expects the binary file to be formatted as follows:
@@ -590,6 +960,7 @@ cv::Mat Attention::getBackProj(cv::Mat imageInput, cv::Mat temp, std::string cSp
  * containing the basis written in a row-major order*/
 void Attention::loadBasis(std::string filename ) {
 
+	releaseBasis();
 	FILE* kernel_file;
 	kernel_file = fopen(filename.c_str(), "rb");
 	float temp;
@@ -619,34 +990,41 @@ void Attention::loadBasis(std::string filename ) {
 		}
 	}
 	fclose(kernel_file);
+	basisFile = filename;
 }
 /* run AIM Attention algorithm on the image
  */
 cv::Mat Attention::runAIM() {
+	Mat aimMap;
+	runAIM(aimMap);
+	return aimMap;
+}
+void Attention::runAIM(cv::Mat &aimMap) {
 	min_aim = 100000;
 	max_aim = -1000000;
 
 	//split image into channels
 	split(image, channels);
 
+	floatChannels.resize(num_channels);
 	for (int c = 0; c < num_channels; c++) {
-		channels[c].convertTo(channels[c], CV_32FC1);
-		channels[c] /= 255.0f;
+		channels[c].convertTo(floatChannels[c], CV_32FC1, 1/255.0f);
 	}
 
+	//only keep the valid pixels after filtering
+	Rect valid((kernel_size)/2, (kernel_size)/2,
+			image.cols - (kernel_size-1)/2 - (kernel_size)/2, image.rows - (kernel_size-1)/2 - (kernel_size)/2);
+
 	//apply all filters to each channel
 	Point anchor(-1, -1);
 	for (int f = 0; f < num_kernels; f++) {
 
-		filter2D(channels[0], aim_temp[f], -1, kernels[f][0], anchor, 0, BORDER_CONSTANT);
+		filter2D(floatChannels[0], aim_temp[f], -1, kernels[f][0], anchor, 0, BORDER_CONSTANT);
 		for(int c = 1; c < num_channels; c++) {
-			filter2D(channels[c], temp, -1, kernels[f][c], anchor, 0, BORDER_CONSTANT);
+			filter2D(floatChannels[c], temp, -1, kernels[f][c], anchor, 0, BORDER_CONSTANT);
 			aim_temp[f] += temp;
 		}
-		//only keep the valid pixels after filtering
-		aim_temp[f] = aim_temp[f].colRange((kernel_size)/2, image.cols - (kernel_size-1)/2)
-																		 .rowRange((kernel_size)/2, image.rows - (kernel_size-1)/2);
-		minMaxLoc(aim_temp[f], &minVal, &maxVal);
+		minMaxLoc(aim_temp[f](valid), &minVal, &maxVal);
 
 		//compute max and min across all feature maps
 		max_aim = fmax(maxVal, max_aim);
@@ -657,27 +1035,31 @@ cv::Mat Attention::runAIM() {
 	printf("Rescaling image ...\n");
 	//rescale image using global max and min
 	for (int f = 0; f < num_kernels; f++) {
-		aim_temp[f] -= min_aim;
-		aim_temp[f] /= (max_aim - min_aim);
+		Mat feature = aim_temp[f](valid);
+		feature -= min_aim;
+		feature /= (max_aim - min_aim);
 	}
 
 	//compute histograms for each feature map
 	//and use them to rescale values based on histogram to reflect likelihood
 	printf("Computing histograms for each feature ...\n");
-	Mat hist;
-	Mat sm = Mat(aim_temp[0].rows, aim_temp[0].cols, CV_32FC1, Scalar::all(0));;
-	float div = (aim_temp[0].rows*aim_temp[0].cols);
+	sm.create(valid.height, valid.width, CV_32FC1);
+	sm.setTo(Scalar::all(0));
+	float div = (valid.height*valid.width);
 	float histRange[] = {0, 1};
 	const float *range[] = {histRange};
 	int histSize[] = {256};
 	for (int f = 0; f < num_kernels; f++) {
-		calcHist(&aim_temp[f], 1, 0, Mat(), hist, 1, histSize, range, true, false);
-		for(int i = 0; i < aim_temp[f].rows; i++) {
-			for (int j = 0; j < aim_temp[f].cols; j++) {
+		Mat feature = aim_temp[f](valid);
+		calcHist(&feature, 1, 0, Mat(), hist, 1, histSize, range, true, false);
+		for(int i = 0; i < feature.rows; i++) {
+			const float* featureRow = feature.ptr<float>(i);
+			float* smRow = sm.ptr<float>(i);
+			for (int j = 0; j < feature.cols; j++) {
 				//find index of the value in the histogram
-				int idx = round(aim_temp[f].at<float>(i, j) * (histSize[0]-1));
+				int idx = round(featureRow[j] * (histSize[0]-1));
 				//compute log probability
-				sm.at<float>(i,j) -= log(hist.at<float>(idx)/div+0.000001f);
+				smRow[j] -= log(hist.at<float>(idx)/div+0.000001f);
 			}
 		}
 	}
@@ -686,24 +1068,57 @@ cv::Mat Attention::runAIM() {
 	minMaxLoc(sm, &minVal, &maxVal);
 
 	//rescale to [0, 255] for viewing
-	sm.convertTo(adj_sm, CV_8UC1, 255/(maxVal-minVal), -minVal);
+	sm.convertTo(smByte, CV_8UC1, 255/(maxVal-minVal), -minVal);
 	//add blank border
 	int border = kernel_size/2;
-	copyMakeBorder(adj_sm, adj_sm, border, border, border, border, BORDER_CONSTANT, 0);
-
-	//rescale image back to the original size
-	resize(adj_sm, adj_sm, cvSize(0, 0), 1/scale , 1/scale);
+	if (scale == 1)
+	{
+		copyMakeBorder(smByte, adj_sm, border, border, border, border, BORDER_CONSTANT, 0);
+	}else
+	{
+		copyMakeBorder(smByte, smBordered, border, border, border, border, BORDER_CONSTANT, 0);
+		//rescale image back to the original size
+		resize(smBordered, adj_sm, cvSize(0, 0), 1/scale , 1/scale);
+	}
 	//imshow("SM", adj_sm);
-	return percentileThreshold(adj_sm, percentile);
+	if (streamingPercentile)
+	{
+		aimPercentile.threshold(adj_sm, aimMap, percentile);
+	}else
+	{
+		percentileThreshold(adj_sm, aimMap, percentile);
+	}
+}
+// Thresholds the AIM maps of consecutive frames with a percentile tracked over the frames,
+// forgetting older frames by decay, instead of the percentile of each map on its own
+void Attention::setStreamingPercentile(bool enable, double decay)
+{
+	streamingPercentile = enable;
+	aimPercentile.decay = decay;
+	aimPercentile.reset();
 }
 cv::Mat Attention::getAIM(cv::Mat imageInput, float percent, float scale_factor, string basisName )
 {
-	image = imageInput;
-	printf("Loaded Image size: %i x %i\n", image.rows, image.cols);
+	Mat aimMap;
+	getAIM(imageInput, aimMap, percent, scale_factor, basisName);
+	return aimMap;
+}
+// Same as above but reuses the buffers of this object between calls.
+// The basis is only read again when a different file is requested.
+void Attention::getAIM(const cv::Mat &imageInput, cv::Mat &aimMap, float percent, float scale_factor, std::string basisName)
+{
+	printf("Loaded Image size: %i x %i\n", imageInput.rows, imageInput.cols);
 	scale = scale_factor;
 	percentile = percent;
-	resize(image, image, cvSize(0, 0), scale, scale);
-	this->loadBasis(basisName);
-	return this->runAIM();
+	if (scale == 1)
+	{
+		image = imageInput;
+	}else
+	{
+		resize(imageInput, scaledInput, cvSize(0, 0), scale, scale);
+		image = scaledInput;
+	}
+	if (basisName != basisFile)
+		this->loadBasis(basisName);
+	this->runAIM(aimMap);
 }
-
@@ -45,6 +45,30 @@ robotSpeed = 350;//max speed 700 mm/sec
 robotRadius = 350;//mm
 robotLength = 650;//mm
 robotWidth = 500;//mm
+robotHeight = 1000;//mm  Obstacles above it do not block the robot
+}
+//TODO  Set the saliency parameters
+SaliencyConfig::SaliencyConfig()
+{
+	masking = maskInput; // Apply the AIM mask before (maskInput) or after (maskOutput) backprojection
+	consistency = waitFresh; // Wait for the current saliency map (waitFresh), use the last one (useStale) or drop it (cancelStale)
+	// Saliency maps are reused when the robot looks at the same image from the same quantized pose
+	cacheBytes = 64 << 20;
+	cachePositionStep = 100; //mm
+	cacheAngleStep = 1; //degrees
+	// Once the buffers are sized, generating a saliency map should not allocate. Counts them to check it
+	countAllocations = false;
+	// For video input, threshold AIM with a percentile tracked over the frames (stable and a single pass per frame)
+	streamingPercentile = false;
+	percentileDecay = 0.9; // Weight kept by the previous frames at every new one
+}
+//TODO  Set the lookahead planner parameters
+PlannerConfig::PlannerConfig()
+{
+	horizon = 3; // Number of actions planned ahead, only the first one is executed
+	beamWidth = 8; // Number of plans kept at every step of the beam search
+	branching = 32; // The plans are extended with this many of the best single actions
+	budget = 1.0; // Wall clock time in seconds, the best plan found so far is returned after it
 }
 EnvConfig::EnvConfig() {
 	initWithDefaults();}
@@ -64,6 +88,10 @@ void EnvConfig::initWithDefaults()
 	recognitionMaxRadius = 3000.f;
 	recognitionMinRadius= 500.f;
 
-	searchMethod = SearchConfig::lookMove; // The seach methods, greedy, lookMove, lookMoveUnknown
+	searchMethod = SearchConfig::lookMove; // The seach methods, greedy, lookMove, lookAhead
+	scoringMethod = SearchConfig::frustumScoring; // How the directions are scored, frustumScoring or sectorScoring
 	searchThreshold = 0.03; // The search threshold for lookMove methods
+	workerThreads = 0; // Number of threads of every OpenCV parallel loop in the process (cv::setNumThreads), 0 uses all the cores
+	branchAndBound = false; // Prune the greedy policies with upper bounds from the mass pyramid, the chosen policy is the same
+	planningDeadline = 0; // Anytime greedy search returning the best policy found within this many seconds, e.g. 0.1 for replans during motion. Only greedy with frustumScoring, see PlannerConfig::budget for lookAhead
 }
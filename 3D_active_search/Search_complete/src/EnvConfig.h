@@ -14,7 +14,10 @@
 
 namespace SearchConfig
 {
-	enum searchMethod {greedy, lookMove};
+	enum searchMethod {greedy, lookMove, lookAhead};
+	// frustumScoring sums the voxels each direction sees, sectorScoring sums the bins of a polar
+	// histogram of the mass around the location that fall inside the field of view
+	enum scoringMethod {frustumScoring, sectorScoring};
 }
 
 class PanTiltConfig
@@ -51,6 +54,39 @@ public:
 	int robotRadius;//mm
 	int robotLength;//mm
 	int robotWidth ;//mm
+	int robotHeight;//mm
+};
+class SaliencyConfig
+{
+public:
+	SaliencyConfig();
+	~SaliencyConfig(){};
+	// maskInput backprojects the image masked by AIM, maskOutput runs AIM and backprojection
+	// concurrently and masks the backprojection instead
+	enum maskingMode {maskInput, maskOutput};
+	maskingMode masking;
+	// What the search does with a saliency map that is still being computed when it plans:
+	// waitFresh waits for it, useStale uses the last finished map, cancelStale drops it
+	enum consistencyPolicy {waitFresh, useStale, cancelStale};
+	consistencyPolicy consistency;
+	size_t cacheBytes;	//memory limit of the saliency cache, 0 disables it
+	double cachePositionStep;	//mm
+	double cacheAngleStep;	//degrees
+	bool countAllocations;	//counts the cv::Mat allocations of every saliency map, see Environment::getSaliencyAllocations
+	// The AIM map is thresholded at a percentile. streamingPercentile tracks it over the frames,
+	// forgetting older frames by percentileDecay, instead of computing it on each map alone
+	bool streamingPercentile;
+	double percentileDecay;
+};
+class PlannerConfig
+{
+public:
+	PlannerConfig();
+	~PlannerConfig(){};
+	int horizon;	//number of actions of a plan
+	int beamWidth;	//plans kept at every step
+	int branching;	//best single actions the plans are extended with
+	double budget;	//seconds
 };
 class EnvConfig {
 	friend class Environment;
@@ -65,8 +101,17 @@ class EnvConfig {
 		PanTiltConfig PTConf;
 		CameraConfig CamConf;
 		RobotConfig RobotConf;
+		SaliencyConfig SalConf;
+		PlannerConfig PlanConf;
 		SearchConfig::searchMethod  searchMethod;
+		SearchConfig::scoringMethod scoringMethod;
 		double searchThreshold;
+		//threads of the parallel loops, 0 keeps the default of OpenCV. This is cv::setNumThreads, a
+		//setting of the whole process: it also applies to the saliency stage and any other user of OpenCV
+		int workerThreads;
+		bool branchAndBound;	//greedy search only evaluates the policies whose bound can win
+		double planningDeadline;	//seconds the greedy search with frustumScoring may take, 0 evaluates every policy.
+									//lookMove ignores it and lookAhead takes PlanConf.budget
 	private:
 		void initWithDefaults();
 };
@@ -28,21 +28,49 @@ using namespace std;
 
 //Initialization
 Environment::Environment() {
+	// the search settings start from the defaults of the configuration
+	EnvConfig defaults;
+	method = defaults.searchMethod;
+	scoring = defaults.scoringMethod;
+	_branchAndBound = defaults.branchAndBound;
+	_planningDeadline = defaults.planningDeadline;
 	_voxelSize =0;
+	_reachabilityDirty = true;
+	_travelRadius = std::numeric_limits<float>::infinity();
+	_envScale = _envMass = 0;
+	_envLive = 0;
+	_envUniform = false;
+	_envUniformValue = 0;
+	_saliencyAllocations = 0;
 	_saliency = new Attention;
 }
 Environment::~Environment() {
-	// TODO Auto-generated destructor stub
+	delete _saliency;
 }
 Environment* Environment::_instance = NULL;
 Environment::Environment(EnvConfig &c)
 {
+	_saliency = new Attention;
 	init(c);
 }
 void Environment::clearAll()
 {
 	_environment3D.release();
+	_clearedBricks.clear();
+	_liveMask.release();
+	_columnMass.release();
+	_annulusKernel.release();
+	_massPyramid.clear();
+	_policyMasses.clear();
+	_dirty = Rect();
+	_clearance.release();
+	_reachLabels.release();
+	_reachabilityDirty = true;
+	_travelField.release();
+	_travelRadius = std::numeric_limits<float>::infinity();
 	_obstacleMap.release();
+	_saliencyMap.release();
+	_envTransform.release();
 	_voxelSize = 0;
 	_robotPos = Point2d(0, 0);
 	_robotDir = 0;
@@ -50,6 +78,7 @@ void Environment::clearAll()
 void Environment::init(EnvConfig c)
 {
 	clearAll();
+	_frustumTemplates.clear();
 	_voxelSize = c.voxelSize;
 	_envMapSize[0] = round(((double)c.envSize.y) / _voxelSize); // y dimension, rows
 	_envMapSize[1] = round(((double)c.envSize.x) / _voxelSize); // x dimension, columns
@@ -57,21 +86,43 @@ void Environment::init(EnvConfig c)
 
 	double prob;
 	method = c.searchMethod;
+	scoring = c.scoringMethod;
+	// the thread count of OpenCV is global, it also changes the saliency stage and other users
+	if (c.workerThreads > 0)
+		setNumThreads(c.workerThreads);
 	searchThreshold = c.searchThreshold;
 
 	prob = 1. / ((double)_envMapSize[0] * _envMapSize[1] * _envMapSize[2]);
 
 
-	_environment3D = Mat(3, _envMapSize, CV_64F, Scalar::all(prob));
-	_obstacleMap = Mat(3,_envMapSize, CV_32F, Scalar::all(UNKNOWN_SPACE_FLAG));
-	_saliencyMap = Mat(3,_envMapSize, CV_32F, Scalar::all(UNKNOWN_SPACE_FLAG));
-	_envTransform = Mat(3, _envMapSize, CV_32FC3, Scalar::all(0));
+	_environment3D.create(_envMapSize, 1.);
+	_envLive = (size_t)_envMapSize[0] * _envMapSize[1] * _envMapSize[2];
+	_envMass = _envLive;
+	_envScale = prob;
+	_liveMask.create(_envMapSize, true);
+	_envUniform = true;
+	_envUniformValue = 1.;
+	_columnMass = Mat(_envMapSize[0], _envMapSize[1], CV_64F, Scalar::all(_envMapSize[2]));
+	buildMassPyramid();
+	_branchAndBound = c.branchAndBound;
+	_planningDeadline = c.planningDeadline;
+	if (_planningDeadline > 0 && (method != SearchConfig::greedy || scoring != SearchConfig::frustumScoring))
+		cout << "The planning deadline only applies to the greedy search with frustum scoring and is ignored\n";
+	_obstacleMap.create(_envMapSize, UNKNOWN_SPACE_FLAG);
+	_saliencyMap.create(_envMapSize, UNKNOWN_SPACE_FLAG);
+	_envTransform.create(_envMapSize, Vec3f(0, 0, 0));
 	setRobotPos(c.robotPos);
 	setRobotDir(c.robotDir);
 	_CamConfig = c.CamConf;
 	_CamConfig.cameraHeight = round((double)c.CamConf.cameraHeight / _voxelSize);
 	_PTConfig = c.PTConf;
 	_RobConfig = c.RobotConf;
+	_SalConfig = c.SalConf;
+	_saliency->setStreamingPercentile(c.SalConf.streamingPercentile, c.SalConf.percentileDecay);
+	_saliencyAllocations = 0;
+	if (c.SalConf.countAllocations)
+		AllocationCounter::install();
+	_PlanConfig = c.PlanConf;
 	_recMaxRange = c.recognitionMaxRadius;
 	_recMinRange = c.recognitionMinRadius;
 	_instance = this;
@@ -108,20 +159,140 @@ vector<CameraViewDirection> Environment::buildListOfViewDirections()
 
 //Search
 
+// Generates the policies of a range of locations. Every location only reads the search map and
+// writes its own directions.
+class PolicyEvaluation : public cv::ParallelLoopBody
+{
+public:
+	PolicyEvaluation(Environment &env, std::vector<ProbabilityLocations> &pointList,
+			const std::vector<CameraViewDirection> &directions)
+	: env(env), pointList(pointList), directions(directions) {}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		for (int i = range.start; i < range.end; i++)
+			pointList[i].directions = env.generatePolicies(pointList[i].p, directions);
+	}
+
+private:
+	Environment &env;
+	std::vector<ProbabilityLocations> &pointList;
+	const std::vector<CameraViewDirection> &directions;
+};
+
+// Extends plans of the beam with actions, each pair independently. The pairs that start after the
+// deadline are left undone.
+class PlanExpansion : public cv::ParallelLoopBody
+{
+public:
+	PlanExpansion(Environment &env, const std::vector<PlanNode> &beam, const std::vector<std::pair<int, int> > &candidates,
+			const std::vector<ProbabilityLocations> &pointList, const std::vector<CameraViewDirection> &directions,
+			int64 deadline, std::vector<PlanNode> &children, std::vector<uchar> &done)
+	: env(env), beam(beam), candidates(candidates), pointList(pointList), directions(directions),
+	  deadline(deadline), children(children), done(done) {}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		for (int n = range.start; n < range.end; n++)
+		{
+			if (cv::getTickCount() >= deadline)
+				return;
+			done[n] = env.expandPlan(beam[candidates[n].first], candidates[n].second, pointList, directions, children[n]);
+		}
+	}
+
+private:
+	Environment &env;
+	const std::vector<PlanNode> &beam;
+	const std::vector<std::pair<int, int> > &candidates;
+	const std::vector<ProbabilityLocations> &pointList;
+	const std::vector<CameraViewDirection> &directions;
+	int64 deadline;
+	std::vector<PlanNode> &children;
+	std::vector<uchar> &done;
+};
+
+// Evaluates the policies of a range of the anytime order. The ones that start after the deadline
+// are left undone, except the first of the order so that there is always a policy to return.
+class CandidateEvaluation : public cv::ParallelLoopBody
+{
+public:
+	CandidateEvaluation(Environment &env, const std::vector<ProbabilityLocations> &pointList,
+			const std::vector<CameraViewDirection> &directions, const std::vector<std::pair<double, int> > &order,
+			int64 deadline, std::vector<double> &probs, std::vector<uchar> &done)
+	: env(env), pointList(pointList), directions(directions), order(order),
+	  deadline(deadline), probs(probs), done(done) {}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		for (int e = range.start; e < range.end; e++)
+		{
+			if (e > 0 && cv::getTickCount() >= deadline)
+				return;
+			int n = -order[e].second;
+			CameraViewDirection dir = directions[n%directions.size()];
+			probs[e] = env.calculateProbabilityOfViewPoint(dir, pointList[n/directions.size()].p);
+			done[e] = 1;
+		}
+	}
+
+private:
+	Environment &env;
+	const std::vector<ProbabilityLocations> &pointList;
+	const std::vector<CameraViewDirection> &directions;
+	const std::vector<std::pair<double, int> > &order;
+	int64 deadline;
+	std::vector<double> &probs;
+	std::vector<uchar> &done;
+};
+
+// Computes the probability seen by a range of directions from one location
+class DirectionEvaluation : public cv::ParallelLoopBody
+{
+public:
+	DirectionEvaluation(Environment &env, cv::Point3d location, std::vector<CameraViewDirection> &directions)
+	: env(env), location(location), directions(directions) {}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		for (int i = range.start; i < range.end; i++)
+			directions[i].Prob = env.calculateProbabilityOfViewPoint(directions[i], location);
+	}
+
+private:
+	Environment &env;
+	cv::Point3d location;
+	std::vector<CameraViewDirection> &directions;
+};
+
 // Choose the best policies at each time
 vector<BestPolicy> Environment::chooseBestAction(vector<CameraViewDirection> directions)
 {
+	// the deadline starts here. The travel field stops at it, the reachability rebuilt after the
+	// obstacle map changed and the list of locations always run to the end.
+	int64 deadline = getTickCount() + (int64)(_planningDeadline*getTickFrequency());
 	if (method == SearchConfig::lookMove)
 	{
+		// only the cell of the robot is scored, it costs no travel with or without the field
 		return chooseBestActionLookMove(directions);
+	}
+	// the other methods cost the locations by the travel along the free space. The anytime search
+	// gives the field at most half of its time, the policies get the rest.
+	bool anytime = (method == SearchConfig::greedy && _planningDeadline > 0 && scoring == SearchConfig::frustumScoring);
+	updateTravelField(anytime ? getTickCount() + (deadline - getTickCount())/2 : 0);
+	if(method == SearchConfig::greedy)
+	{
+		if (anytime)
+			return chooseBestActionAnytime(directions, deadline);
+		return chooseBestActionGreedy(directions);
 	}else
-		if(method == SearchConfig::greedy)
-		{
-			return chooseBestActionGreedy(directions);
-		}else
-		{
-			return chooseBestActionGreedy(directions);
-		}
+	if(method == SearchConfig::lookAhead)
+	{
+		return chooseBestActionLookAhead(directions);
+	}else
+	{
+		return chooseBestActionGreedy(directions);
+	}
 }
 vector<BestPolicy> Environment::chooseBestActionGreedy(vector<CameraViewDirection> directions)
 {
@@ -131,16 +302,18 @@ vector<BestPolicy> Environment::chooseBestActionGreedy(vector<CameraViewDirectio
 	BestPolicy bestDir;
 	buildLocationList(pointList);
 
-	//	QtConcurrent::blockingMap(pointList, [this, directions](ProbabilityLocations &data)
-	//	{
-	//		data.directions = calculateDirectionsProbabilities(data, directions);
-	//	});
-
-	for (unsigned int i = 0; i < pointList.size();i++)
+	// Locations are independent, one stripe each lets the idle threads take the remaining ones
+	int64 start = getTickCount();
+	int evaluated = pointList.size()*directions.size();
+	if (_branchAndBound && scoring == SearchConfig::frustumScoring)
+	{
+		bestDir = chooseBestPolicyBounded(pointList, directions, evaluated);
+	}else
 	{
-		pointList[i].directions = generatePolicies(pointList[i].p,directions);
+		parallel_for_(Range(0, pointList.size()), PolicyEvaluation(*this, pointList, directions), pointList.size());
+		bestDir = chooseBestPolicy(pointList);
 	}
-	bestDir = chooseBestPolicy(pointList);
+	double elapsed = (getTickCount() - start)/getTickFrequency();
 
 	//		QFile file(SearchConfiguration::getLogFileName());
 	//		file.open(QIODevice::Append | QIODevice::Text);
@@ -151,11 +324,342 @@ vector<BestPolicy> Environment::chooseBestActionGreedy(vector<CameraViewDirectio
 			"Position:   " << "(" << bestDir.p.x << "," << bestDir.p.y << ")\n"
 			<< "Direction(pan,tilt):    " << "(" << bestDir.direction.Pan << "," << bestDir.direction.Tilt << ")\n"
 			<< "Utility Value :    " << bestDir.util << "\n"
-			<< "Distance:   " << bestDir.distance << "\n" ;//<<
-	//"Time Elapsed to Choose Policy:    " << timer.elapsed() << "\n";
+			<< "Distance:   " << bestDir.distance << "\n"
+			<< "Time Elapsed to Choose Policy:    " << elapsed << " s on " << getNumThreads() << " threads\n"
+			<< "Policies Evaluated:    " << evaluated << " of " << pointList.size()*directions.size() << "\n";
+	dir.push_back(bestDir);
+	return dir;
+}
+// Evaluates the policies by decreasing estimate, the probability cached from the previous steps or
+// else the bound of the mass pyramid, over the cost that grows with the distance. The nearest
+// locations are estimated first and at most half of the time left is spent on it. The evaluation
+// stops at the deadline or when no estimate left can beat the keep best policies. views holds the
+// evaluated policies, best first and ties by policy order, and ids their index in pointList x
+// directions. Returns the number of policies evaluated or known not to beat the keep best ones.
+size_t Environment::evaluateByEstimate(const vector<ProbabilityLocations> &pointList,
+		const vector<CameraViewDirection> &directions, int64 deadline, int keep,
+		vector<CameraViewDirection> &views, vector<int> &ids)
+{
+	float pan = 0.f;
+	float junk = 0.f;
+	getPanTilt(pan, junk);
+	float robotDir = getRobotDir();
+	size_t total = pointList.size()*directions.size();
+	// coarse cells of about a quarter of the range, a bound sums a few dozen of them
+	int level = 0;
+	while (level < (int)_massPyramid.size() && (2 << level) <= _recMaxRange/ _voxelSize/ 4)
+		level++;
+
+	vector<pair<double, int> > order;
+	for (unsigned int i = 0; i < pointList.size(); i++)
+		order.push_back(make_pair(estimateCost(pan, pan, pointList[i].p), i));
+	sort(order.begin(), order.end());
+
+	int64 scoreDeadline = getTickCount() + (deadline - getTickCount())/2;
+	vector<pair<double, int> > estimates;
+	vector<float> costs(total);
+	for (size_t o = 0; o < order.size() && (o == 0 || getTickCount() < scoreDeadline); o++)
+	{
+		int i = order[o].second;
+		for (unsigned int j = 0; j < directions.size(); j++)
+		{
+			int n = i*directions.size() + j;
+			costs[n] = estimateCost(pan, directions[j].Pan, pointList[i].p);
+			double estimate;
+			if (!cachedProbability(directions[j], pointList[i].p, estimate))
+				estimate = massBound(pointList[i].p, directions[j].Pan + robotDir, level)*_envScale;
+			// the utilities are kept as floats, the margin keeps a rounded up tie from being pruned
+			estimate = estimate*(1 + 1e-6);
+			estimates.push_back(make_pair((costs[n] == 0) ? estimate : estimate/costs[n], -n));
+		}
+	}
+	sort(estimates.begin(), estimates.end(), greater<pair<double, int> >());
+
+	// batches keep the threads busy between the checks of the deadline
+	int batch = 4*max(getNumThreads(), 1);
+	vector<double> probs(estimates.size());
+	vector<uchar> done(estimates.size(), 0);
+	// ((utility, -policy), place in evaluated), ties keep the first policy as in chooseBestPolicy
+	vector<pair<pair<double, int>, int> > ranked;
+	vector<CameraViewDirection> evaluated;
+	// the keep best utilities so far, the worst of them on top
+	priority_queue<float, vector<float>, greater<float> > kept;
+	bool pruned = false;
+	for (size_t b = 0; b < estimates.size() && !pruned && (b == 0 || getTickCount() < deadline); b += batch)
+	{
+		Range range(b, min(b + batch, estimates.size()));
+		parallel_for_(range, CandidateEvaluation(*this, pointList, directions, estimates, deadline, probs, done));
+		for (int e = range.start; e < range.end; e++)
+		{
+			float bound = ((int)kept.size() < keep) ? 0.f : kept.top();
+			if (estimates[e].first <= 0 || estimates[e].first < bound)
+			{
+				pruned = true;
+				break;
+			}
+			if (!done[e])
+				break;
+			int n = -estimates[e].second;
+			CameraViewDirection view = directions[n%directions.size()];
+			view.Prob = probs[e];
+			view.cost = costs[n];
+			view.utility = (view.cost == 0) ? view.Prob : view.Prob / view.cost;
+			ranked.push_back(make_pair(make_pair((double)view.utility, -n), (int)evaluated.size()));
+			evaluated.push_back(view);
+			kept.push(view.utility);
+			if ((int)kept.size() > keep)
+				kept.pop();
+		}
+	}
+	sort(ranked.begin(), ranked.end(), greater<pair<pair<double, int>, int> >());
+	views.clear();
+	ids.clear();
+	for (size_t r = 0; r < ranked.size(); r++)
+	{
+		views.push_back(evaluated[ranked[r].second]);
+		ids.push_back(-ranked[r].first.second);
+	}
+	// a pruned search has ruled out every policy that was scored
+	return pruned ? estimates.size() : evaluated.size();
+}
+// Greedy choice that returns by the deadline, the policies are evaluated by decreasing estimate
+// until the deadline or until no estimate can beat the best one. The first policy is evaluated even
+// after the deadline, and so is the frustum template it needs, so a step can overrun by one build.
+// With no policy that sees anything the robot stays and keeps its view. completeness is the
+// fraction of the policies that were evaluated or known to be worse, 1 when the result is the one
+// of chooseBestActionGreedy.
+vector<BestPolicy> Environment::chooseBestActionAnytime(vector<CameraViewDirection> directions, int64 deadline)
+{
+	int64 start = getTickCount();
+	vector<ProbabilityLocations> pointList;
+	vector<BestPolicy> dir;
+	BestPolicy bestDir = BestPolicy();
+	buildLocationList(pointList);
+	Point2d robotPos = getRobotPos();
+	size_t total = pointList.size()*directions.size();
+
+	vector<CameraViewDirection> views;
+	vector<int> ids;
+	size_t resolved = evaluateByEstimate(pointList, directions, deadline, 1, views, ids);
+	size_t evaluated = views.size();
+	if (views.empty() || views[0].utility <= 0)
+	{
+		// no location, every estimate is 0 or no policy evaluated sees anything
+		float pan, tilt;
+		getPanTilt(pan, tilt);
+		bestDir.p = Point3d(robotPos.x, robotPos.y, _CamConfig.cameraHeight*_voxelSize);
+		bestDir.direction = CameraViewDirection(pan, tilt);
+		cout << "No policy of " << total << " sees any probability, the robot keeps its view\n";
+	}else
+	{
+		const CameraViewDirection &view = views[0];
+		bestDir.prob = view.Prob;
+		bestDir.p = pointList[ids[0]/directions.size()].p *_voxelSize;
+		bestDir.direction = view;
+		bestDir.cost = view.cost;
+		bestDir.util = view.utility;
+		bestDir.distance = sqrt(SQR(robotPos.x-bestDir.p.x)+SQR(robotPos.y-bestDir.p.y));
+	}
+	bestDir.completeness = (total == 0) ? 1. : (double)resolved/total;
+	double elapsed = (getTickCount() - start)/getTickFrequency();
+
+	cout << "*******Best Direction Statistics, Anytime*******\n" <<
+			"Prob:    " << bestDir.prob << "\n" <<
+			"Position:   " << "(" << bestDir.p.x << "," << bestDir.p.y << ")\n"
+			<< "Direction(pan,tilt):    " << "(" << bestDir.direction.Pan << "," << bestDir.direction.Tilt << ")\n"
+			<< "Utility Value :    " << bestDir.util << "\n"
+			<< "Distance:   " << bestDir.distance << "\n"
+			<< "Time Elapsed to Choose Policy:    " << elapsed << " s of " << _planningDeadline << " s\n"
+			<< "Policies Evaluated:    " << evaluated << " of " << total << ", completeness " << bestDir.completeness << "\n";
 	dir.push_back(bestDir);
 	return dir;
 }
+// Receding horizon search over sequences of (location, pan, tilt) actions. A beam of the best plans
+// is extended one action at a time. The voxels an action sees are cleared in the view of its plan
+// only, and the plans are scored by the probability they see per second. The best plan found before
+// the budget runs out is returned and only its first action is meant to be executed. The budget is
+// best effort: the list of locations and at least one policy are always done, and a frustum
+// template that is not cached yet is built to the end.
+vector<BestPolicy> Environment::chooseBestActionLookAhead(vector<CameraViewDirection> directions)
+{
+	int64 start = getTickCount();
+	int64 deadline = start + (int64)(_PlanConfig.budget*getTickFrequency());
+	vector<ProbabilityLocations> pointList;
+	buildLocationList(pointList);
+
+	// the first actions are the best policies of the greedy search that the budget gets to
+	vector<CameraViewDirection> views;
+	vector<int> ids;
+	size_t resolved = evaluateByEstimate(pointList, directions, deadline, _PlanConfig.branching, views, ids);
+	vector<int> pool;
+	for (size_t n = 0; n < views.size() && (int)pool.size() < _PlanConfig.branching; n++)
+		if (views[n].utility > 0)
+			pool.push_back(ids[n]);
+	vector<PlanNode> beam;
+	PlanNode root;
+	root.prob = root.cost = 0;
+	for (size_t n = 0; n < pool.size() && (int)beam.size() < _PlanConfig.beamWidth
+			&& (n == 0 || getTickCount() < deadline); n++)
+	{
+		PlanNode node;
+		if (expandPlan(root, pool[n], pointList, directions, node))
+			beam.push_back(node);
+	}
+	if (beam.empty())
+		return chooseBestActionAnytime(directions, deadline);
+	PlanNode best = beam[0];
+
+	int depth = 1;
+	int expanded = beam.size();
+	for (; depth < _PlanConfig.horizon && getTickCount() < deadline; depth++)
+	{
+		vector<pair<int, int> > candidates;
+		for (size_t b = 0; b < beam.size(); b++)
+			for (size_t n = 0; n < pool.size(); n++)
+				if (find(beam[b].actions.begin(), beam[b].actions.end(), pool[n]) == beam[b].actions.end())
+					candidates.push_back(make_pair(b, pool[n]));
+		vector<PlanNode> children(candidates.size());
+		vector<uchar> done(candidates.size(), 0);
+		parallel_for_(Range(0, candidates.size()), PlanExpansion(*this, beam, candidates, pointList, directions,
+				deadline, children, done), candidates.size());
+
+		// the extended plans are ranked, plans cut by the deadline are dropped
+		vector<pair<double, int> > ranked;
+		for (size_t n = 0; n < children.size(); n++)
+			if (done[n])
+				ranked.push_back(make_pair(children[n].score(), -(int)n));
+		sort(ranked.begin(), ranked.end(), greater<pair<double, int> >());
+		expanded += ranked.size();
+		vector<PlanNode> next;
+		for (size_t n = 0; n < ranked.size() && (int)next.size() < _PlanConfig.beamWidth; n++)
+			next.push_back(children[-ranked[n].second]);
+		if (next.empty())
+			break;
+		beam.swap(next);
+		if (beam[0].score() > best.score())
+			best = beam[0];
+		if (ranked.size() < candidates.size())
+			break;
+	}
+
+	double elapsed = (getTickCount() - start)/getTickFrequency();
+	cout << "*******Best Plan Statistics, LookAhead*******\n"
+			<< "Actions:    " << best.policies.size() << " of a horizon of " << _PlanConfig.horizon << ", depth searched " << depth << "\n"
+			<< "Prob:    " << best.prob << "\n"
+			<< "Cost:   " << best.cost << "\n"
+			<< "Utility Value:    " << best.score() << "\n"
+			<< "First Position:   " << "(" << best.policies[0].p.x << "," << best.policies[0].p.y << ")\n"
+			<< "First Direction(pan,tilt):    " << "(" << best.policies[0].direction.Pan << "," << best.policies[0].direction.Tilt << ")\n"
+			<< "First Actions Evaluated:    " << views.size() << ", resolved " << resolved << " of " << pointList.size()*directions.size() << "\n"
+			<< "Plans Evaluated:    " << expanded << " in " << elapsed << " s of " << _PlanConfig.budget << " s\n";
+	return best.policies;
+}
+
+// Extends a plan with an action. The probability of the action is the mass of its frustum the plan
+// has not seen yet. Returns false if the action sees nothing new.
+bool Environment::expandPlan(const PlanNode &node, int action, const vector<ProbabilityLocations> &pointList,
+		const vector<CameraViewDirection> &directions, PlanNode &child)
+{
+	int i = action/directions.size();
+	CameraViewDirection dir = directions[action%directions.size()];
+	Point3d location = pointList[i].p;
+	float corrPan = dir.Pan + getRobotDir();
+	shared_ptr<const vector<FrustumRun> > frustum = getFrustumTemplate(corrPan, dir.Tilt, location);
+	int x = floor(location.x);
+	int y = floor(location.y);
+	dir.Prob = planMass(*frustum, x, y, node.view.get())*_envScale;
+	if (dir.Prob <= 0)
+		return false;
+
+	// the first action starts from the robot, the next ones from the previous action
+	if (node.policies.empty())
+	{
+		float pan, junk;
+		getPanTilt(pan, junk);
+		dir.cost = estimateCost(pan, dir.Pan, location);
+	}else
+	{
+		const BestPolicy &prev = node.policies.back();
+		double dist = sqrt(SQR(prev.p.x - location.x*_voxelSize) + SQR(prev.p.y - location.y*_voxelSize));
+		dir.cost = fabs(dir.Pan - prev.direction.Pan)*0.027 + dist/_RobConfig.robotSpeed;
+	}
+	dir.utility = (dir.cost == 0) ? dir.Prob : dir.Prob / dir.cost;
+
+	BestPolicy policy;
+	policy.prob = dir.Prob;
+	policy.p = location*_voxelSize;
+	policy.direction = dir;
+	policy.cost = dir.cost;
+	policy.util = dir.utility;
+	policy.distance = sqrt(SQR(getRobotPos().x - policy.p.x) + SQR(getRobotPos().y - policy.p.y));
+
+	child.actions = node.actions;
+	child.actions.push_back(action);
+	child.policies = node.policies;
+	child.policies.push_back(policy);
+	child.prob = node.prob + dir.Prob;
+	child.cost = node.cost + dir.cost;
+	child.view = planLook(*frustum, x, y, node.view);
+	return true;
+}
+
+// Stored mass of the frustum runs at (x, y) that the layers of the view have not cleared
+double Environment::planMass(const vector<FrustumRun> &runs, int x, int y, const PlanView *view)
+{
+	double res = 0.;
+	vector<pair<int, int> > cleared;
+	for (size_t r = 0; r < runs.size(); r++)
+	{
+		int i = x + runs[r].di;
+		int j = y + runs[r].dj;
+		if (i < 0 || i >= _environment3D.size(1) || j < 0 || j >= _environment3D.size(0))
+			continue;
+		cleared.clear();
+		for (const PlanView *v = view; v != NULL; v = v->parent.get())
+		{
+			unordered_map<int, vector<pair<int, int> > >::const_iterator found = v->cleared.find(j*_environment3D.size(1) + i);
+			if (found != v->cleared.end())
+				cleared.insert(cleared.end(), found->second.begin(), found->second.end());
+		}
+		sort(cleared.begin(), cleared.end());
+
+		// walks the run skipping the cleared parts
+		int k = runs[r].k0;
+		for (size_t c = 0; c <= cleared.size() && k < runs[r].k1; c++)
+		{
+			int end = (c < cleared.size()) ? min(cleared[c].first, runs[r].k1) : runs[r].k1;
+			if (end > k)
+			{
+				if (_envUniform)
+					res += _liveMask.count(j, i, k, end)*_envUniformValue;
+				else
+					for (int n = k; n < end; n++)
+						res += _environment3D.get(j, i, n);
+			}
+			if (c < cleared.size())
+				k = max(k, cleared[c].second);
+		}
+	}
+	return res;
+}
+
+// New layer of a view with the frustum runs at (x, y) cleared
+shared_ptr<const PlanView> Environment::planLook(const vector<FrustumRun> &runs, int x, int y,
+		const shared_ptr<const PlanView> &parent)
+{
+	shared_ptr<PlanView> view = make_shared<PlanView>();
+	view->parent = parent;
+	for (size_t r = 0; r < runs.size(); r++)
+	{
+		int i = x + runs[r].di;
+		int j = y + runs[r].dj;
+		if (i < 0 || i >= _environment3D.size(1) || j < 0 || j >= _environment3D.size(0))
+			continue;
+		view->cleared[j*_environment3D.size(1) + i].push_back(make_pair(runs[r].k0, runs[r].k1));
+	}
+	return view;
+}
+
 vector<BestPolicy> Environment::chooseBestActionLookMove(vector<CameraViewDirection> directions)
 {
 	vector<ProbabilityLocations> pointList;
@@ -171,11 +675,19 @@ vector<BestPolicy> Environment::chooseBestActionLookMove(vector<CameraViewDirect
 		buildLocationList(pointList);
 		ProbabilityLocations nextLocation;
 		nextLocation.probVisible= 0.;
-		Mat locDisplay(_environment3D.size[0],_environment3D.size[1], CV_32F, Scalar::all(0));
+		Mat locDisplay(_environment3D.size(0),_environment3D.size(1), CV_32F, Scalar::all(0));
 		int gridSize = 2*_RobConfig.robotRadius/_voxelSize;
+		// the annulus sums of all the cells are computed at once and sampled at the locations
+		Mat visible;
+		computeProbVisibleMap(visible);
 		for (unsigned int i = 0; i< pointList.size();i++)
 		{
-			pointList[i].probVisible = computeTotalProbVisibleFromPoint(pointList[i]);
+			int x = pointList[i].p.x;
+			int y = pointList[i].p.y;
+			if (x >= 0 && x < visible.cols && y >= 0 && y < visible.rows)
+				pointList[i].probVisible = visible.ptr<double>(y)[x];
+			else
+				pointList[i].probVisible = computeTotalProbVisibleFromPoint(pointList[i]);
 			rectangle(locDisplay, Rect(pointList[i].p.x - gridSize / 2, pointList[i].p.y -
 					gridSize / 2, gridSize + 1, gridSize + 1), pointList[i].probVisible, CV_FILLED);
 			if(pointList[i].probVisible > nextLocation.probVisible)
@@ -215,6 +727,8 @@ BestPolicy Environment::chooseBestPolicy(vector<ProbabilityLocations> pointList)
 	bestDir.util = 0.f;
 	Point2d robotPos = getRobotPos();
 	double utility;
+	// the scan is serial and keeps the first of equal utilities, so the choice does not depend
+	// on how the policies were evaluated
 	for (unsigned int i = 0; i < pointList.size(); i++){
 		for (unsigned int j = 0; j < pointList[i].directions.size(); j++){
 
@@ -263,6 +777,13 @@ void  Environment::buildLocationList(vector<ProbabilityLocations> &pointList)
 	float robotRadiusSqr = SQR(gridSize/2);
 	Point2d robotLocalCord = Point2d(_robotPos.x/_voxelSize,_robotPos.y/_voxelSize);
 	float cameraHeight = _CamConfig.cameraHeight/_voxelSize;
+	if (_reachabilityDirty)
+		updateReachability();
+	// only the cells connected to the robot are kept. If the robot itself is too close to an
+	// obstacle all the cells with clearance are used.
+	int robotLabel = 0;
+	if (robotLocalCord.x >= 0 && robotLocalCord.x < _reachLabels.cols && robotLocalCord.y >= 0 && robotLocalCord.y < _reachLabels.rows)
+		robotLabel = _reachLabels.ptr<int>((int)robotLocalCord.y)[(int)robotLocalCord.x];
 	///Current Position of the Robot to add to the list
 
 	ProbabilityLocations t;
@@ -272,14 +793,15 @@ void  Environment::buildLocationList(vector<ProbabilityLocations> &pointList)
 
 
 	//****************Calculate Locations*********************
-	for (int j = gridSize / 2.; j < _environment3D.size[0] - (_environment3D.size[0] % gridSize); j = j + gridSize) // for(int j = 0; j < _obstacleMap.rows; j++)
+	for (int j = gridSize / 2.; j < _environment3D.size(0) - (_environment3D.size(0) % gridSize); j = j + gridSize) // for(int j = 0; j < _obstacleMap.rows; j++)
 	{
 
-		for (int i = gridSize / 2.; i < _environment3D.size[1]- (_environment3D.size[1] % gridSize); i = i + gridSize) //for(int i = 0; i < _obstacleMap.cols; i++)
+		for (int i = gridSize / 2.; i < _environment3D.size(1)- (_environment3D.size(1) % gridSize); i = i + gridSize) //for(int i = 0; i < _obstacleMap.cols; i++)
 		{
 			float distSqr = SQR(i - robotLocalCord .x) + SQR(j - robotLocalCord .y);
-			float location =  _obstacleMap.ptr<schar>(j)[i];
-			if (location <= 0 &&	//point is not inside an obstacle
+			int label = _reachLabels.ptr<int>(j)[i];
+			if (label > 0 &&	//the robot fits at the point
+					(robotLabel == 0 || label == robotLabel) &&	//and can get there
 					distSqr > robotRadiusSqr)
 			{
 
@@ -292,14 +814,104 @@ void  Environment::buildLocationList(vector<ProbabilityLocations> &pointList)
 	}
 
 }
+// Projects the obstacles onto the floor, finds how far every cell is from them and labels the
+// connected regions of the cells with at least the robot radius of clearance
+void Environment::updateReachability()
+{
+	// only obstacles up to the height of the robot block a cell
+	int height = min(_obstacleMap.size(2), (int)ceil(_RobConfig.robotHeight/ _voxelSize));
+	Mat freeSpace(_obstacleMap.size(0), _obstacleMap.size(1), CV_8U, Scalar::all(255));
+	for (int j = 0; j < _obstacleMap.size(0); j++)
+		for (int i = 0; i < _obstacleMap.size(1); i++)
+			for (int k = 0; k < height; k++)
+				if (_obstacleMap.get(j, i, k) > 0)
+				{
+					freeSpace.ptr<uchar>(j)[i] = 0;
+					break;
+				}
+
+	distanceTransform(freeSpace, _clearance, DIST_L2, DIST_MASK_PRECISE);
+	Mat fits = _clearance >= (float)(_RobConfig.robotRadius/_voxelSize);
+	connectedComponents(fits, _reachLabels, 8, CV_32S);
+	_reachabilityDirty = false;
+}
+// Dijkstra over the 8-connected cells from the cell of the robot. The robot moves through the cells
+// with at least the robot radius of clearance, or as much as it has where it stands if that is less.
+// A deadline other than 0 stops the search, the field is then exact up to the distance reached.
+void Environment::updateTravelField(int64 deadline)
+{
+	if (_reachabilityDirty)
+		updateReachability();
+	int rows = _clearance.rows;
+	int cols = _clearance.cols;
+	_travelField.create(rows, cols, CV_32F);
+	_travelField.setTo(Scalar::all(std::numeric_limits<float>::infinity()));
+	int x = _robotPos.x/_voxelSize;
+	int y = _robotPos.y/_voxelSize;
+	if (x < 0 || x >= cols || y < 0 || y >= rows)
+	{
+		_travelField.release();
+		return;
+	}
+	float clearance = min(_clearance.ptr<float>(y)[x], (float)(_RobConfig.robotRadius/_voxelSize));
+	const int dx[8] = {1, -1, 0, 0, 1, 1, -1, -1};
+	const int dy[8] = {0, 0, 1, -1, 1, -1, 1, -1};
+	const float step[8] = {1, 1, 1, 1, (float)M_SQRT2, (float)M_SQRT2, (float)M_SQRT2, (float)M_SQRT2};
+
+	priority_queue<pair<float, int>, vector<pair<float, int> >, greater<pair<float, int> > > open;
+	_travelField.ptr<float>(y)[x] = 0;
+	open.push(make_pair(0.f, y*cols + x));
+	_travelRadius = std::numeric_limits<float>::infinity();
+	// the clock is read once per batch of cells
+	size_t popped = 0;
+	while (!open.empty())
+	{
+		float d = open.top().first;
+		if (deadline > 0 && (++popped & 1023) == 0 && getTickCount() >= deadline)
+		{
+			// every cell closer than d is done, the ones at d hold their distance already
+			_travelRadius = d;
+			break;
+		}
+		int r = open.top().second/cols;
+		int c = open.top().second%cols;
+		open.pop();
+		if (d > _travelField.ptr<float>(r)[c])
+			continue;
+		for (int n = 0; n < 8; n++)
+		{
+			int rn = r + dy[n];
+			int cn = c + dx[n];
+			if (rn < 0 || rn >= rows || cn < 0 || cn >= cols || _clearance.ptr<float>(rn)[cn] < clearance)
+				continue;
+			float dn = d + step[n]*_voxelSize;
+			if (dn < _travelField.ptr<float>(rn)[cn])
+			{
+				_travelField.ptr<float>(rn)[cn] = dn;
+				open.push(make_pair(dn, rn*cols + cn));
+			}
+		}
+	}
+}
 vector<CameraViewDirection> Environment::generatePolicies(Point3d location, vector<CameraViewDirection> directions)
 {
 	float pan = 0.f;
 	float junk = 0.f;
 	getPanTilt(pan, junk);
+	float robotDir = getRobotDir();
+	if (scoring == SearchConfig::sectorScoring)
+	{
+		Mat hist, sums;
+		buildSectorHistogram(location, hist, sums);
+		for (unsigned int i = 0; i < directions.size(); i++)
+			directions[i].Prob = sectorProbability(sums, directions[i].Pan + robotDir, directions[i].Tilt);
+	}else
+	{
+		// inside a PolicyEvaluation this runs serially on the thread of the location
+		parallel_for_(Range(0, directions.size()), DirectionEvaluation(*this, location, directions), directions.size());
+	}
 	for (unsigned int i = 0; i < directions.size(); i++)
 	{
-		directions[i].Prob = calculateProbabilityOfViewPoint(directions[i], location);
 		directions[i].cost = estimateCost(pan, directions[i].Pan, location);
 		directions[i].utility = (directions[i].cost == 0) ? directions[i].Prob : directions[i].Prob / directions[i].cost;
 
@@ -307,52 +919,372 @@ vector<CameraViewDirection> Environment::generatePolicies(Point3d location, vect
 
 	return directions;
 }
+PolicyKey Environment::policyKey(const CameraViewDirection &dir, Point3d probLocs)
+{
+	int x = floor(probLocs.x);
+	int y = floor(probLocs.y);
+	PolicyKey key;
+	key.x = x;
+	key.y = y;
+	key.frustum.corrPan = dir.Pan + getRobotDir();
+	key.frustum.tilt = dir.Tilt;
+	key.frustum.fx = probLocs.x - x;
+	key.frustum.fy = probLocs.y - y;
+	key.frustum.z = probLocs.z;
+	return key;
+}
+// Probability of a policy evaluated at a previous step whose frustum has not been cleared since
+bool Environment::cachedProbability(const CameraViewDirection &dir, Point3d probLocs, double &prob)
+{
+	PolicyKey key = policyKey(dir, probLocs);
+	AutoLock lock(_policyMassMutex);
+	map<PolicyKey, PolicyMass>::iterator found = _policyMasses.find(key);
+	if (found == _policyMasses.end())
+		return false;
+	prob = found->second.mass*_envScale;
+	return true;
+}
 double Environment::calculateProbabilityOfViewPoint(CameraViewDirection &dir, Point3d probLocs)
 {
+	float corrPan = dir.Pan + getRobotDir();
+	int x = floor(probLocs.x);
+	int y = floor(probLocs.y);
+	PolicyKey key = policyKey(dir, probLocs);
+	{
+		AutoLock lock(_policyMassMutex);
+		map<PolicyKey, PolicyMass>::iterator found = _policyMasses.find(key);
+		if (found != _policyMasses.end())
+			return found->second.mass*_envScale;
+	}
+
+	shared_ptr<const vector<FrustumRun> > frustum = getFrustumTemplate(corrPan, dir.Tilt, probLocs);
+	const vector<FrustumRun> &runs = *frustum;
+	double res = 0.;
+	int iMin = INT_MAX, iMax = INT_MIN, jMin = INT_MAX, jMax = INT_MIN;
+
+	// the runs are ordered by column as the grid was swept, so the sum is the same
+	for (size_t r = 0; r < runs.size(); r++)
+	{
+		int i = x + runs[r].di;
+		int j = y + runs[r].dj;
+		if (i < 0 || i >= _environment3D.size(1) || j < 0 || j >= _environment3D.size(0))
+			continue;
+		iMin = min(iMin, i); iMax = max(iMax, i);
+		jMin = min(jMin, j); jMax = max(jMax, j);
+		if (_envUniform)
+			res += _liveMask.count(j, i, runs[r].k0, runs[r].k1);
+		else
+			for (int k = runs[r].k0; k < runs[r].k1; k++)
+				res += _environment3D.get(j, i, k);
+	}
+	if (_envUniform)
+		res *= _envUniformValue;
+
+	PolicyMass policy;
+	policy.mass = res;
+	policy.bounds = (iMin <= iMax) ? Rect(iMin, jMin, iMax - iMin + 1, jMax - jMin + 1) : Rect();
+	{
+		AutoLock lock(_policyMassMutex);
+		if (_policyMasses.size() >= MAX_POLICY_MASSES)
+			_policyMasses.clear();
+		_policyMasses[key] = policy;
+	}
+	return res*_envScale;
+}
+
+// Finds the voxels inside the field of view and the recognition range of a direction. Each column
+// is scanned upwards until it leaves the field of view, and the voxels within range are kept as runs.
+shared_ptr<const vector<FrustumRun> > Environment::getFrustumTemplate(float corrPan, float tilt, Point3d probLocs)
+{
+	int x = floor(probLocs.x);
+	int y = floor(probLocs.y);
+	FrustumKey key;
+	key.corrPan = corrPan;
+	key.tilt = tilt;
+	key.fx = probLocs.x - x;
+	key.fy = probLocs.y - y;
+	key.z = probLocs.z;
+
+	{
+		AutoLock lock(_frustumMutex);
+		map<FrustumKey, shared_ptr<const vector<FrustumRun> > >::iterator found = _frustumTemplates.find(key);
+		if (found != _frustumTemplates.end())
+			return found->second;
+	}
+
+	// the template is built without the lock, so the other threads keep using the cached ones
 	const double HFOV = _CamConfig.cameraHorizontalViewAngle/ 2.;
 	float recMaxRange =  _recMaxRange/ _voxelSize;
 	float recMinRange =  _recMinRange/_voxelSize;
-	float robotDir = getRobotDir();
-	double res = 0.;
-	float corrPan = dir.Pan + robotDir;
-
-	for (int i = 0; i < _environment3D.size[1]; i++)
+	// offsets are taken from a viewpoint at (fx, fy) of the cell (0, 0), which gives the
+	// same vectors as the grid coordinates minus the actual viewpoint
+	Point3d origin(key.fx, key.fy, key.z);
+	Rect bounds = wedgeBounds(Point2d(origin.x, origin.y), corrPan, HFOV, recMaxRange);
+	shared_ptr<vector<FrustumRun> > frustum = make_shared<vector<FrustumRun> >();
+	vector<FrustumRun> &runs = *frustum;
+
+	for (int di = bounds.x; di < bounds.x + bounds.width; di++)
 	{
-		for (int j = 0; j < _environment3D.size[0]; j++)
+		for (int dj = bounds.y; dj < bounds.y + bounds.height; dj++)
 		{
-			for (int k = 0; k < _environment3D.size[2]; k++)
+			// a column outside the pan stops at its first voxel
+			if (outsideView(corrPan, getAngleOfVector(Point2d(origin.x,origin.y), Point2d(di,dj)), HFOV))
+				continue;
+			FrustumRun run;
+			run.di = di;
+			run.dj = dj;
+			run.k0 = -1;
+			for (int k = 0; k < _environment3D.size(2); k++)
 			{
-				Point3d p(i, j, k);
-				Point3d vec = p - probLocs;
+				Point3d p(di, dj, k);
+				Point3d vec = p - origin;
 				double length = sqrt(SQR(vec.x) + SQR(vec.y)+SQR(vec.z));
 				float angV = acos(vec.z/length)*180/PI;
-				float angH= getAngleOfVector(Point2d(probLocs.x,probLocs.y), Point2d(p.x,p.y));
-
-				if (	  (fabs(corrPan - angH) >HFOV
-						&& fabs(corrPan + 360 - angH) > HFOV
-						&& fabs(corrPan - 360 - angH) > HFOV)
-						||
-						fabs((90-angV)-dir.Tilt) >HFOV)
 
+				// the pan of the column was checked above
+				if (fabs((90-angV)-tilt) >HFOV)
 				{
 					break;
 				}
 				else if (length < recMaxRange && length > recMinRange)
 				{
-					res += _environment3D.ptr<double>(j)[i*_environment3D.size[2]+k];
+					if (run.k0 < 0)
+						run.k0 = k;
+					run.k1 = k + 1;
+				}
+				else if (run.k0 >= 0)
+				{
+					runs.push_back(run);
+					run.k0 = -1;
 				}
 			}
+			if (run.k0 >= 0)
+				runs.push_back(run);
+		}
+	}
+
+	// a thread that built the same template first wins and its copy is used
+	AutoLock lock(_frustumMutex);
+	map<FrustumKey, shared_ptr<const vector<FrustumRun> > >::iterator found = _frustumTemplates.find(key);
+	if (found != _frustumTemplates.end())
+		return found->second;
+	// templates still in use by other threads are kept alive by their pointers
+	if (_frustumTemplates.size() >= MAX_FRUSTUM_TEMPLATES)
+		_frustumTemplates.clear();
+	_frustumTemplates[key] = frustum;
+	return frustum;
+}
+
+// Bins the mass within the recognition range of a location by azimuth and elevation. The azimuth
+// axis is stored twice so that every field of view is a rectangle of the integral image.
+void Environment::buildSectorHistogram(Point3d location, Mat &hist, Mat &sums)
+{
+	const int azimuthBins = 360*SECTOR_BINS_PER_DEGREE;
+	const int elevationBins = 180*SECTOR_BINS_PER_DEGREE;
+	float recMaxRange =  _recMaxRange/ _voxelSize;
+	float recMinRange =  _recMinRange/_voxelSize;
+	int xStart = max(0, (int)floor(location.x - recMaxRange));
+	int xEnd = min(_environment3D.size(1), (int)ceil(location.x + recMaxRange) + 1);
+	int yStart = max(0, (int)floor(location.y - recMaxRange));
+	int yEnd = min(_environment3D.size(0), (int)ceil(location.y + recMaxRange) + 1);
+
+	hist.create(2*azimuthBins, elevationBins, CV_64F);
+	hist.setTo(Scalar::all(0));
+	for (int i = xStart; i < xEnd; i++)
+	{
+		for (int j = yStart; j < yEnd; j++)
+		{
+			float angH = getAngleOfVector(Point2d(location.x,location.y), Point2d(i,j));
+			int a = min((int)(angH*SECTOR_BINS_PER_DEGREE), azimuthBins - 1);
+			for (int k = 0; k < _environment3D.size(2); k++)
+			{
+				double value = _environment3D.get(j, i, k);
+				if (value == 0)
+					continue;
+				Point3d vec = Point3d(i, j, k) - location;
+				double length = sqrt(SQR(vec.x) + SQR(vec.y)+SQR(vec.z));
+				if (length < recMaxRange && length > recMinRange)
+				{
+					float elevation = 90 - acos(vec.z/length)*180/PI;
+					int e = min((int)((elevation + 90)*SECTOR_BINS_PER_DEGREE), elevationBins - 1);
+					hist.ptr<double>(a)[e] += value*_envScale;
+				}
+			}
+		}
+	}
+	Mat wrapped = hist.rowRange(azimuthBins, 2*azimuthBins);
+	hist.rowRange(0, azimuthBins).copyTo(wrapped);
+	integral(hist, sums, CV_64F);
+}
+
+// Sums the bins of the sector histogram inside the field of view of a direction
+double Environment::sectorProbability(const Mat &sums, float corrPan, float tilt)
+{
+	const int azimuthBins = 360*SECTOR_BINS_PER_DEGREE;
+	const int elevationBins = 180*SECTOR_BINS_PER_DEGREE;
+	const double HFOV = _CamConfig.cameraHorizontalViewAngle/ 2.;
+	int width = min((int)round(2*HFOV*SECTOR_BINS_PER_DEGREE), azimuthBins);
+	int a0 = (int)round((corrPan - HFOV)*SECTOR_BINS_PER_DEGREE) % azimuthBins;
+	if (a0 < 0)
+		a0 += azimuthBins;
+	int a1 = a0 + width;
+	int e0 = max(0, (int)round((tilt - HFOV + 90)*SECTOR_BINS_PER_DEGREE));
+	int e1 = min(elevationBins, (int)round((tilt + HFOV + 90)*SECTOR_BINS_PER_DEGREE));
+	if (e1 <= e0)
+		return 0.;
+	return sums.ptr<double>(a1)[e1] - sums.ptr<double>(a0)[e1]
+			- sums.ptr<double>(a1)[e0] + sums.ptr<double>(a0)[e0];
+}
+
+// Sums the column masses in blocks of 2x2 cells level by level, up to a single cell
+void Environment::buildMassPyramid()
+{
+	_massPyramid.clear();
+	Mat prev = _columnMass;
+	while (prev.rows > 1 || prev.cols > 1)
+	{
+		Mat level((prev.rows + 1)/2, (prev.cols + 1)/2, CV_64F, Scalar::all(0));
+		for (int r = 0; r < prev.rows; r++)
+			for (int c = 0; c < prev.cols; c++)
+				level.ptr<double>(r/2)[c/2] += prev.ptr<double>(r)[c];
+		_massPyramid.push_back(level);
+		prev = level;
+	}
+}
+
+// Upper bound on the stored mass a direction can see from a location. Every pyramid cell whose
+// columns can be within range and inside the pan is counted with all of its mass.
+double Environment::massBound(Point3d location, float corrPan, int level)
+{
+	const double HFOV = _CamConfig.cameraHorizontalViewAngle/ 2.;
+	float recMaxRange =  _recMaxRange/ _voxelSize;
+	const Mat &mass = (level == 0) ? _columnMass : _massPyramid[level - 1];
+	int cell = 1 << level;
+	Point2d origin(location.x, location.y);
+	Rect bounds = wedgeBounds(origin, corrPan, HFOV, recMaxRange)
+			& Rect(0, 0, _environment3D.size(1), _environment3D.size(0));
+	if (bounds.area() == 0)
+		return 0.;
+	// the pan is widened by a degree to cover the error of fastAtan2
+	double half = HFOV + 1;
+	double res = 0.;
+
+	for (int r = bounds.y/cell; r <= (bounds.y + bounds.height - 1)/cell; r++)
+	{
+		for (int c = bounds.x/cell; c <= (bounds.x + bounds.width - 1)/cell; c++)
+		{
+			double value = mass.ptr<double>(r)[c];
+			if (value <= 0)
+				continue;
+			// columns of the cell, as points
+			double x0 = c*cell, x1 = min((c + 1)*cell, _environment3D.size(1)) - 1;
+			double y0 = r*cell, y1 = min((r + 1)*cell, _environment3D.size(0)) - 1;
+			double dx = max(max(x0 - origin.x, 0.), origin.x - x1);
+			double dy = max(max(y0 - origin.y, 0.), origin.y - y1);
+			if (SQR(dx) + SQR(dy) >= SQR(recMaxRange))
+				continue;
+			if (half < 180 && (dx > 0 || dy > 0))
+			{
+				// azimuth interval of the corners, unwrapped around the first one
+				double corners[4][2] = {{x0, y0}, {x1, y0}, {x0, y1}, {x1, y1}};
+				double first = getAngleOfVector(origin, Point2d(corners[0][0], corners[0][1]));
+				double low = 0, high = 0;
+				for (int n = 1; n < 4; n++)
+				{
+					double d = getAngleOfVector(origin, Point2d(corners[n][0], corners[n][1])) - first;
+					if (d > 180) d -= 360;
+					if (d < -180) d += 360;
+					low = min(low, d);
+					high = max(high, d);
+				}
+				// distance from the pan to the interval, on the circle
+				double centre = first + (low + high)/2;
+				double gap = fabs(fmod(corrPan - centre, 360.));
+				if (gap > 180)
+					gap = 360 - gap;
+				if (gap > half + (high - low)/2)
+					continue;
+			}
+			res += value;
 		}
 	}
 	return res;
 }
 
+// Greedy choice of chooseBestPolicy without evaluating every policy. The policies are visited by
+// decreasing bound on their utility and the search stops once no bound can beat the best one.
+// Ties are resolved by the order of the locations and directions, as in chooseBestPolicy.
+BestPolicy Environment::chooseBestPolicyBounded(vector<ProbabilityLocations> &pointList,
+		const vector<CameraViewDirection> &directions, int &evaluated)
+{
+	BestPolicy bestDir;
+	bestDir.util = 0.f;
+	Point2d robotPos = getRobotPos();
+	float pan = 0.f;
+	float junk = 0.f;
+	getPanTilt(pan, junk);
+	float robotDir = getRobotDir();
+	// coarse cells of about an eighth of the range
+	int level = 0;
+	while (level < (int)_massPyramid.size() && (2 << level) <= _recMaxRange/ _voxelSize/ 8)
+		level++;
+
+	vector<pair<double, int> > bounds;
+	vector<float> costs(pointList.size()*directions.size());
+	for (unsigned int i = 0; i < pointList.size(); i++)
+	{
+		for (unsigned int j = 0; j < directions.size(); j++)
+		{
+			int n = i*directions.size() + j;
+			costs[n] = estimateCost(pan, directions[j].Pan, pointList[i].p);
+			double bound = massBound(pointList[i].p, directions[j].Pan + robotDir, level)*_envScale;
+			// the utilities are kept as floats, the margin keeps a rounded up tie from being pruned
+			bound = bound*(1 + 1e-6);
+			bounds.push_back(make_pair((costs[n] == 0) ? bound : bound/costs[n], n));
+		}
+	}
+	sort(bounds.begin(), bounds.end(), greater<pair<double, int> >());
+
+	int best = -1;
+	evaluated = 0;
+	for (size_t b = 0; b < bounds.size() && bounds[b].first > 0 && bounds[b].first >= bestDir.util; b++)
+	{
+		int n = bounds[b].second;
+		int i = n/directions.size();
+		int j = n%directions.size();
+		CameraViewDirection dir = directions[j];
+		dir.Prob = calculateProbabilityOfViewPoint(dir, pointList[i].p);
+		dir.cost = costs[n];
+		dir.utility = (dir.cost == 0) ? dir.Prob : dir.Prob / dir.cost;
+		evaluated++;
+		if (dir.utility > bestDir.util || (dir.utility == bestDir.util && best >= 0 && n < best))
+		{
+			best = n;
+			bestDir.prob = dir.Prob;
+			bestDir.p = pointList[i].p *_voxelSize;
+			bestDir.direction = dir;
+			bestDir.cost = dir.cost;
+			bestDir.util = dir.utility;
+			bestDir.distance = sqrt(SQR(robotPos.x-bestDir.p.x)+SQR(robotPos.y-bestDir.p.y));
+		}
+	}
+	return bestDir;
+}
+
 // Estimates the cost of each policy
 float Environment::estimateCost(float pan, float dirPan, Point3d location)
 {
 	Point2d robotPos = getRobotPos();
-	float dist = sqrt(SQR(robotPos.x / _voxelSize - location.x) + SQR(robotPos.y / _voxelSize - location.y))*_voxelSize;
 	double panTiltTime = fabs(dirPan - pan)*0.027;
+	int x = location.x;
+	int y = location.y;
+	if (!_travelField.empty() && x >= 0 && x < _travelField.cols && y >= 0 && y < _travelField.rows
+			&& _travelField.ptr<float>(y)[x] <= _travelRadius)
+	{
+		// distance along the free space from the travel field
+		return panTiltTime + _travelField.ptr<float>(y)[x]/_RobConfig.robotSpeed;
+	}
+	float dist = sqrt(SQR(robotPos.x / _voxelSize - location.x) + SQR(robotPos.y / _voxelSize - location.y))*_voxelSize;
 	double travelTime = (dist<=_CamConfig.cameraEffectiveRange) ?///_voxelSize
 			dist/_RobConfig.robotSpeed  :
 			(dist-_CamConfig.cameraEffectiveRange)*dist/_RobConfig.robotSpeed;
@@ -366,33 +1298,52 @@ double Environment::computeTotalProbVisibleFromPoint(ProbabilityLocations &point
 	double res = 0.;
 	int xStart, xEnd, yStart, yEnd;
 	xStart = ((point.p.x - radius) < 0) ? 0 : point.p.x - radius;
-	xEnd = ((point.p.x + radius) > _environment3D.size[1]) ? _environment3D.size[1] : point.p.x + radius;
+	xEnd = ((point.p.x + radius) > _environment3D.size(1)) ? _environment3D.size(1) : point.p.x + radius;
 	yStart = ((point.p.y - radius) < 0) ? 0 : point.p.y - radius;
-	yEnd = ((point.p.y + radius) > _environment3D.size[0]) ? _environment3D.size[0] : point.p.y + radius;
+	yEnd = ((point.p.y + radius) > _environment3D.size(0)) ? _environment3D.size(0) : point.p.y + radius;
 
 	Point2i r;
 	r.x = point.p.x;
 	r.y = point.p.y;
 
+	// the annulus only depends on the column, so the column masses are summed
 
 	for (int i = xStart; i < xEnd; i++)//_enviroment3D.size[1]
 	{
 		for (int j = yStart; j < yEnd; j++)//_enviroment3D.size[0]
 		{
-			for (int k = 0; k < _environment3D.size[2]; k++)
+			Point2i p(i, j);
+			Point2f vec = p - r;
+			double lengthSqr = (SQR(vec.x) + SQR(vec.y));
+			if (lengthSqr < maxRangeSquare && lengthSqr > minRangeSquare)
+				res += _columnMass.ptr<double>(j)[i];
+		}
+	}
+	return res*_envScale;
+}
+
+// Probability within the recognition annulus of every cell. The annulus sum over the column masses
+// is a correlation with an annulus kernel, which filter2D computes with the DFT for large radii.
+void Environment::computeProbVisibleMap(Mat &visible)
+{
+	double radius = _recMaxRange/ _voxelSize;
+	double maxRangeSquare = SQR(radius);
+	float minRangeSquare = SQR(_recMinRange / _voxelSize);
+	if (_annulusKernel.empty())
+	{
+		int reach = ceil(radius);
+		_annulusKernel = Mat(2*reach + 1, 2*reach + 1, CV_64F, Scalar::all(0));
+		for (int dy = -reach; dy <= reach; dy++)
+			for (int dx = -reach; dx <= reach; dx++)
 			{
-				Point2i p(i, j);
-				Point2f vec = p - r;
+				Point2f vec(dx, dy);
 				double lengthSqr = (SQR(vec.x) + SQR(vec.y));
 				if (lengthSqr < maxRangeSquare && lengthSqr > minRangeSquare)
-				{
-					res += _environment3D.ptr<double>(j)[i*_environment3D.size[2]+k];
-				}
-
+					_annulusKernel.ptr<double>(dy + reach)[dx + reach] = 1.;
 			}
-		}
 	}
-	return res;
+	filter2D(_columnMass, visible, CV_64F, _annulusKernel, Point(-1, -1), 0, BORDER_CONSTANT);
+	visible *= _envScale;
 }
 
 //Global Functions
@@ -404,11 +1355,43 @@ float Environment::getAngleOfVector(Point2d origin, Point2d p)
 	float angle = fastAtan2(-v.y, v.x);
 	return angle;
 }
-cv::Mat Environment::imageToMap(cv::Mat salMap)
+// Bounding box of the columns a view can reach, the wedge of half angle HFOV around corrPan within
+// range. The wedge is widened by a degree to cover the error of fastAtan2.
+Rect Environment::wedgeBounds(Point2d origin, float corrPan, double HFOV, double range)
+{
+	double half = HFOV + 1;
+	double minX = origin.x, maxX = origin.x, minY = origin.y, maxY = origin.y;
+	if (half >= 180)
+	{
+		minX -= range; maxX += range;
+		minY -= range; maxY += range;
+	}else
+	{
+		vector<double> angles;
+		angles.push_back(corrPan - half);
+		angles.push_back(corrPan + half);
+		// the arc reaches further than its ends where it crosses an axis
+		for (double a = ceil((corrPan - half)/90)*90; a <= corrPan + half; a += 90)
+			angles.push_back(a);
+		for (size_t n = 0; n < angles.size(); n++)
+		{
+			double x = origin.x + range*cos(angles[n]*PI/180);
+			double y = origin.y - range*sin(angles[n]*PI/180);
+			minX = min(minX, x); maxX = max(maxX, x);
+			minY = min(minY, y); maxY = max(maxY, y);
+		}
+	}
+	int x0 = floor(minX);
+	int y0 = floor(minY);
+	return Rect(x0, y0, (int)ceil(maxX) - x0 + 1, (int)ceil(maxY) - y0 + 1);
+}
+// Projects the saliency probability map of the current frame into _saliencyMap, which is cleared
+// first. Only the bricks the projected pixels fall in hold voxels.
+void Environment::imageToMap(const cv::Mat &salMap)
 {
 	//TODO: Complete this function to read the depthmap from the robot and tranform salmap
 	Mat depthImage; // TODO Get the 3 channel depth map from the sensor
-	Mat map = Mat(3,_envMapSize, CV_64F, Scalar::all(0));
+	_saliencyMap.fill(0);
 	Mat depthMap = transformation2D(depthImage); //channel 0 z (depth), channel 1 x
 
 	for (int r = 0; r < depthImage.rows; r++)
@@ -422,11 +1405,10 @@ cv::Mat Environment::imageToMap(cv::Mat salMap)
 			int z = depthMap.ptr<float>(r)[c*4+2]/_voxelSize;
 			if( x > 0 && x < _envMapSize[1] && y > 0 && y <_envMapSize[0] && z > 0 && z <_envMapSize[2])
 			{
-				map.ptr<double>(y)[x*_envMapSize[2]+z] += salMap.ptr<double>(r)[c];
+				_saliencyMap.at(y, x, z) += salMap.ptr<float>(r)[c];
 
 			}
 		}
-	return map;
 }
 cv::Mat Environment::transformation2D(cv::Mat depthImg)
 {
@@ -480,15 +1462,15 @@ cv::Mat Environment::clearNanInf(cv::Mat matrix)
 		}
 	return matrix;
 }
-cv::Mat Environment::map3dTo2d(cv::Mat map)
+cv::Mat Environment::map3dTo2d(const VoxelGrid<float> &map)
 {
-	Mat map2D = Mat(map.size[0],map.size[1], CV_64F, Scalar::all(0));
+	Mat map2D = Mat(map.size(0),map.size(1), CV_64F, Scalar::all(0));
 
-	for (int r = 0 ; r < map.size[0]; r++)
-		for(int c = 0; c < map.size[1]; c++)
-			for(int h = 0 ; h < map.size[2]; h++)
+	for (int r = 0 ; r < map.size(0); r++)
+		for(int c = 0; c < map.size(1); c++)
+			for(int h = 0 ; h < map.size(2); h++)
 			{
-				map2D.ptr<double>(r)[c] +=map.ptr<double>(r)[c*map.size[2] + h];
+				map2D.ptr<double>(r)[c] +=map.get(r, c, h);
 			}
 
 	return map2D;
@@ -523,55 +1505,187 @@ void Environment::calculateNewPan(float &policyPan, float &disPlacement, float p
 	}
 }
 
-cv::Mat Environment::generateSaliencyMap(){
-	Mat aimMap, bpMap,aimMask, imageMasked, salImg, salMap;
+// Copies the pixels of image where mask is set and clears the others
+class MaskedCopy : public cv::ParallelLoopBody
+{
+public:
+	MaskedCopy(const cv::Mat &image, const cv::Mat &mask, cv::Mat &dst)
+	: image(image), mask(mask), dst(dst) {}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		for (int r = range.start; r < range.end; r++)
+		{
+			const uchar* src = image.ptr<uchar>(r);
+			const uchar* m = mask.ptr<uchar>(r);
+			uchar* d = dst.ptr<uchar>(r);
+			for (int c = 0; c < image.cols; c++)
+			{
+				uchar keep = m[c] ? 0xff : 0;
+				d[c*3] = src[c*3] & keep;
+				d[c*3 +1] = src[c*3 +1] & keep;
+				d[c*3 +2] = src[c*3 +2] & keep;
+			}
+		}
+	}
+
+private:
+	const cv::Mat &image, &mask;
+	cv::Mat &dst;
+};
+
+// Blends the AIM and backprojection maps into the 8-bit saliency image and sums the blend.
+// With maskBp the backprojection is only used where AIM is set.
+class SaliencyBlend : public cv::ParallelLoopBody
+{
+public:
+	SaliencyBlend(const cv::Mat &aimMap, const cv::Mat &bpMap, float aimRate, float bpRate, bool maskBp,
+			cv::Mat &salImg, double &total, cv::Mutex &mutex)
+	: aimMap(aimMap), bpMap(bpMap), aimRate(aimRate), bpRate(bpRate), maskBp(maskBp),
+	  salImg(salImg), total(total), mutex(mutex) {}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		double localSum = 0;
+		for (int r = range.start; r < range.end; r++)
+		{
+			const uchar* aim = aimMap.ptr<uchar>(r);
+			const uchar* bp = bpMap.ptr<uchar>(r);
+			uchar* sal = salImg.ptr<uchar>(r);
+			float rowSum = 0;
+			for (int c = 0; c < aimMap.cols; c++)
+			{
+				uchar b = (aim[c] || !maskBp) ? bp[c] : 0;
+				float v = aim[c]*aimRate + b*bpRate;
+				sal[c] = saturate_cast<uchar>(v);
+				rowSum += v;
+			}
+			localSum += rowSum;
+		}
+		cv::AutoLock lock(mutex);
+		total += localSum;
+	}
+
+private:
+	const cv::Mat &aimMap, &bpMap;
+	float aimRate, bpRate;
+	bool maskBp;
+	cv::Mat &salImg;
+	double &total;
+	cv::Mutex &mutex;
+};
+
+// Writes the blend divided by its sum into the float probability map
+class SaliencyProbability : public cv::ParallelLoopBody
+{
+public:
+	SaliencyProbability(const cv::Mat &aimMap, const cv::Mat &bpMap, float aimRate, float bpRate, bool maskBp,
+			cv::Mat &probImg)
+	: aimMap(aimMap), bpMap(bpMap), aimRate(aimRate), bpRate(bpRate), maskBp(maskBp), probImg(probImg) {}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		for (int r = range.start; r < range.end; r++)
+		{
+			const uchar* aim = aimMap.ptr<uchar>(r);
+			const uchar* bp = bpMap.ptr<uchar>(r);
+			float* prob = probImg.ptr<float>(r);
+			for (int c = 0; c < aimMap.cols; c++)
+			{
+				uchar b = (aim[c] || !maskBp) ? bp[c] : 0;
+				prob[c] = aim[c]*aimRate + b*bpRate;
+			}
+		}
+	}
+
+private:
+	const cv::Mat &aimMap, &bpMap;
+	float aimRate, bpRate;
+	bool maskBp;
+	cv::Mat &probImg;
+};
+
+SaliencyMaps Environment::generateSaliencyMap(){
+	return generateSaliencyMap(_envImage);
+}
+// Generates the saliency of an image. Only one call can run at a time since it uses the
+// buffers of this object. The maps returned are new for every call, so they can be kept
+// by the cache while the next image is processed.
+SaliencyMaps Environment::generateSaliencyMap(const cv::Mat &image){
 	int numBins = 64; // Number of histogram nackprojection
 	//String pathToAIMBasis = "../21infomax950.bin";
 	String pathToAIMBasis = "../21infomax950.bin";
 	float precntileThresh = 95;
 	float scaleFactor = 1;
-	double aimRate = 0.2;
-	double bpRate = 0.8;
+	float aimRate = 0.2;
+	float bpRate = 0.8;
 	String bpTempPath = "../red.jpg";
-	aimMask = Mat(_envImage.rows, _envImage.cols, CV_8U, Scalar::all(1)); // Aim mask for generating the final saliency map
-	aimMap = Mat(_envImage.rows, _envImage.cols, CV_8U, Scalar::all(0));
-	bpMap = Mat(_envImage.rows, _envImage.cols, CV_8U, Scalar::all(0));
-	salMap = Mat(3,_envMapSize, CV_64F, Scalar::all(0));
-	Mat envImage = _envImage.clone();
 
-	aimMap = _saliency->getAIM(envImage,precntileThresh, scaleFactor, pathToAIMBasis);
+	if (_bpTemplate.empty() || bpTempPath != _bpTemplatePath)
+	{
+		_bpTemplate = imread(bpTempPath,CV_LOAD_IMAGE_COLOR);
+		_bpTemplatePath = bpTempPath;
+	}
 
-	threshold(aimMap, aimMask, 0,1,THRESH_BINARY);
-	for(int r = 0; r < aimMask.rows; r++)
-		for(int c = 0; c < aimMask.cols; c++)
-		{
-			if (aimMask.ptr<uchar>(r)[c]  == 0)
-			{
-				envImage.ptr<uchar>(r)[c*3] = 0;
-				envImage.ptr<uchar>(r)[c*3 +1] = 0;
-				envImage.ptr<uchar>(r)[c*3 +2] = 0;
-			}
-		}
-	Mat tempImage = imread(bpTempPath,CV_LOAD_IMAGE_COLOR);
+	// only the allocations of this thread and of the AIM task are counted, not those of the planner
+	std::atomic<size_t> allocations(0);
+	std::unique_ptr<AllocationCounter::Scope> counted(new AllocationCounter::Scope(allocations));
+	bool maskOutput = (_SalConfig.masking == SaliencyConfig::maskOutput);
+	if (maskOutput)
+	{
+		// Backprojection is computed per pixel, so masking its output gives the same blend on the
+		// pixels AIM keeps and both maps can be generated at the same time. The two calls use
+		// separate buffers of the Attention object.
+		std::future<void> aimTask = std::async(std::launch::async, [&]() {
+			AllocationCounter::Scope aimCounted(allocations);
+			_saliency->getAIM(image, _aimMap, precntileThresh, scaleFactor, pathToAIMBasis);
+		});
+		_saliency->getBackProj(image, _bpTemplate, _bpMap, "C1C2C3", true, numBins);
+		aimTask.get();
+	}else
+	{
+		_saliency->getAIM(image, _aimMap, precntileThresh, scaleFactor, pathToAIMBasis);
+
+		// the backprojection only looks at the pixels AIM found salient
+		_maskedImage.create(image.rows, image.cols, CV_8UC3);
+		parallel_for_(Range(0, image.rows), MaskedCopy(image, _aimMap, _maskedImage));
+
+		_saliency->getBackProj(_maskedImage, _bpTemplate, _bpMap, "C1C2C3", true, numBins);
+	}
 
-	bpMap = _saliency->getBackProj(envImage,tempImage,"C1C2C3", true, numBins);
+	counted.reset();
+	_saliencyAllocations = allocations.load();
 
-	aimMap.convertTo(aimMap, CV_64F);
-	bpMap.convertTo(bpMap,CV_64F);
-	_saliencyImg = aimMap*aimRate + bpMap*bpRate;
-	salImg = (aimMap*aimRate  + bpMap*bpRate)/255;
-	Scalar sumSal = sum(salImg);
-	salImg /= sumSal[0];
-	salImg = clearNanInf(salImg);
+	// 8-bit blend for display and its sum, then the blend normalized to a probability map.
+	// Scaling by 1/sum also takes care of the division by 255, so an all zero blend stays zero.
+	SaliencyMaps maps;
+	double sumSal = 0;
+	cv::Mutex mutex;
+	maps.image.create(_aimMap.rows, _aimMap.cols, CV_8U);
+	parallel_for_(Range(0, _aimMap.rows), SaliencyBlend(_aimMap, _bpMap, aimRate, bpRate, maskOutput, maps.image, sumSal, mutex));
 
-	// TODO Transforms the final saliency map to
-	//salMap = imageToMap(salImg);
-	//float saliencyConf = 0.005;
-	//Mat updatedMap = salMap*saliencyConf;
-	//return updatedMap;
+	float norm = (sumSal > 0) ? (float)(1./sumSal) : 0.f;
+	maps.prob.create(_aimMap.rows, _aimMap.cols, CV_32F);
+	parallel_for_(Range(0, _aimMap.rows), SaliencyProbability(_aimMap, _bpMap, aimRate*norm, bpRate*norm, maskOutput, maps.prob));
 
-	return salMap; // Comment out once the transformation is fixed
+	// TODO Transform the probability map into the search space. This runs on the saliency thread,
+	// so the projection is done by the search once it has the maps, see updateEnvironment()
+	return maps;
 }
+// Makes the maps of a frame the current saliency. Called by search() on its own thread.
+void Environment::setSaliency(const SaliencyMaps &maps)
+{
+	_saliencyImg = maps.image;
+	_saliencyProb = maps.prob;
+}
+
+// Spreads the probability evenly over the voxels that are still positive
+struct ScaleProbability
+{
+	ScaleProbability(double s) : scale(s) {}
+	double operator()(double v) const { return v*scale; }
+	double scale;
+};
 
 // Updates the probabilities of the search map
 void Environment::updateEnvironment()
@@ -585,101 +1699,150 @@ void Environment::updateEnvironment()
 	const double HFOV = (_CamConfig.cameraHorizontalViewAngle/ 2.);
 	float recMaxRange =  _recMaxRange/ _voxelSize;
 	float recMinRange =  _recMinRange/_voxelSize;
-	for (int i = 0; i < _environment3D.size[1]; i++)
+	// only the columns within range and inside the pan can be cleared
+	Rect bounds = wedgeBounds(Point2d(robotPos.x, robotPos.y), corrPan, HFOV, recMaxRange)
+			& Rect(0, 0, _environment3D.size(1), _environment3D.size(0));
+	for (int i = bounds.x; i < bounds.x + bounds.width; i++)
 	{
-		for (int j = 0; j < _environment3D.size[0]; j++)
+		for (int j = bounds.y; j < bounds.y + bounds.height; j++)
 		{
-			for (int k = 0; k < _environment3D.size[2]; k++)
+			if (outsideView(corrPan, getAngleOfVector(Point2d(robotPos.x,robotPos.y), Point2d(i,j)), HFOV))
+				continue;
+			// the voxels within range are cleared a run at a time
+			int k0 = -1;
+			int k = 0;
+			for (; k < _environment3D.size(2); k++)
 			{
 				Point3d p(i, j, k);
 				Point3d vec = p - robotPos;
 				double length = sqrt(SQR(vec.x) + SQR(vec.y)+SQR(vec.z));
 				float angV = acos(vec.z/length)*180/PI;
-				float angH = getAngleOfVector(Point2d(robotPos.x,robotPos.y), Point2d(p.x,p.y));
-
-
-				if ((fabs(corrPan - angH) > HFOV
-						&& fabs(corrPan + 360 - angH) > HFOV
-						&& fabs(corrPan - 360 - angH) > HFOV)
-						||
-						fabs( (90 - angV)- tilt) > HFOV)
 
+				// the pan of the column was checked above
+				if (fabs( (90 - angV)- tilt) > HFOV)
 				{
 					break;
 				}
 				else if (length < recMaxRange && length > recMinRange)
 				{
-					_environment3D.ptr<double>(j)[i*_environment3D.size[2]+k] = 0;
+					if (k0 < 0)
+						k0 = k;
+				}
+				else if (k0 >= 0)
+				{
+					clearRun(j, i, k0, k);
+					k0 = -1;
 				}
 			}
+			if (k0 >= 0)
+				clearRun(j, i, k0, k);
 		}
 	}
 
 	//TODO Read the saliency value and update the probability values accordingly
-	//Mat saliency3DMap = generateSaliencyMap();
+	//imageToMap(_saliencyProb);
 
 	// Use this function if you want to aggregate saliency values column-wise
 	// and use the 2d resulted saliency map
-    // Mat saliencyMap2D =  map3dTo2d(saliency3DMap);
+    // Mat saliencyMap2D =  map3dTo2d(_saliencyMap);
 
 
-	int numNZero = countNonZero(_environment3D);
-	double prob = 1./numNZero;
-	for (int i = 0; i < _environment3D.size[1]; i++)
+	// the bricks the view wrote to go back to a single value if it cleared them completely
+	sort(_clearedBricks.begin(), _clearedBricks.end());
+	_clearedBricks.erase(unique(_clearedBricks.begin(), _clearedBricks.end()), _clearedBricks.end());
+	_environment3D.compact(_clearedBricks);
+	_clearedBricks.clear();
+
+	// the policies that saw a cleared column are evaluated again, the others keep their mass
+	if (_dirty.area() > 0)
 	{
-		for (int j = 0; j < _environment3D.size[0]; j++)
+		for (map<PolicyKey, PolicyMass>::iterator it = _policyMasses.begin(); it != _policyMasses.end();)
 		{
-			for (int k = 0; k < _environment3D.size[2]; k++)
-			{
-				if(_environment3D.ptr<double>(j)[i*_environment3D.size[2]+k] > 0)
-				{
-					_environment3D.ptr<double>(j)[i*_environment3D.size[2]+k] = prob;
-
-					//Uncomment once generated the saliency map
-					//_environment3D.ptr<double>(j)[i*_environment3D.size[2]+k] = prob +
-					// saliency3DMap.ptr<double>(j)[i*_environment3D.size[2]+k];
-				}
-			}
+			if ((it->second.bounds & _dirty).area() > 0)
+				_policyMasses.erase(it++);
+			else
+				++it;
 		}
+		_dirty = Rect();
 	}
 
+	// The remaining voxels share the mass that was cleared. Only the scale changes, the stored
+	// values are rewritten by materialize() when they are needed as probabilities.
+	_envScale = (_envMass > 0) ? 1./_envMass : 0.;
+
+	//Uncomment once generated the saliency map, materialize() and add to the positive voxels
+	//_saliencyMap.get(j, i, k)*saliencyConf (0.005), keeping _envMass up to date
+
 
 	//TODO Normalize the environment map if saliency is used
 }
 
+// Clears the voxels k0 <= k < k1 of a column of the search map and removes their mass
+void Environment::clearRun(int j, int i, int k0, int k1)
+{
+	int cleared = _liveMask.clear(j, i, k0, k1);
+	if (cleared == 0)
+		return;
+	_envLive -= cleared;
+	double removed = 0.;
+	if (_envUniform)
+		removed = cleared*_envUniformValue;
+	for (int k = k0; k < k1; k++)
+	{
+		if (!_envUniform)
+			removed += _environment3D.get(j, i, k);
+		_environment3D.set(j, i, k, 0);
+	}
+	// one entry per brick of the run, the column crosses a brick every BRICK_SIZE voxels
+	for (int k = k0; k < k1; k = ((k >> VoxelGrid<double>::BRICK_BITS) + 1) << VoxelGrid<double>::BRICK_BITS)
+		_clearedBricks.push_back(_environment3D.brickOf(j, i, k));
+	_envMass -= removed;
+	_columnMass.ptr<double>(j)[i] -= removed;
+	if (_dirty.area() == 0)
+		_dirty = Rect(i, j, 1, 1);
+	else
+		_dirty |= Rect(i, j, 1, 1);
+	for (size_t l = 0; l < _massPyramid.size(); l++)
+		_massPyramid[l].ptr<double>(j >> (l + 1))[i >> (l + 1)] -= removed;
+}
+
+// Writes the probabilities into the stored values of the search map
+void Environment::materialize()
+{
+	if (_envScale == 1.)
+		return;
+	_environment3D.transform(ScaleProbability(_envScale));
+	_envMass *= _envScale;
+	_envUniformValue *= _envScale;
+	for (map<PolicyKey, PolicyMass>::iterator it = _policyMasses.begin(); it != _policyMasses.end(); ++it)
+		it->second.mass *= _envScale;
+	_columnMass *= _envScale;
+	for (size_t l = 0; l < _massPyramid.size(); l++)
+		_massPyramid[l] *= _envScale;
+	_envScale = 1.;
+}
+
 // Visualizes the search environment by generating a 2D map, and identifying the location of the robot
 Mat Environment::visualizeEnvironment()
 {
-	Mat map3d = Mat(_environment3D.size[0], _environment3D.size[1], CV_8UC3, Scalar(255,0,0));
-	Mat obsMap;
-	_obstacleMap.convertTo(obsMap,CV_8UC1);
+	Mat map3d = Mat(_environment3D.size(0), _environment3D.size(1), CV_8UC3, Scalar(255,0,0));
 	// normalize(obsMap,obsMap,50,0,NORM_MINMAX);
 	// double minScale, maxScale;
 	// int minIdx[3], maxIdx[3];
 
 	//minMaxIdx(_environment3D, &minScale, &maxScale, minIdx, maxIdx);
 	//float coef = 200 / maxScale;
-	float intensityEnhance = round(_environment3D.size[0]*_environment3D.size[1]*_environment3D.size[2])*100;//*3;
-	for (int i = 0; i < _environment3D.size[0]; i++){
-		for (int j = 0; j < _environment3D.size[1]; j++){
-			for (int k = 0; k < _environment3D.size[2]; k++){
-				// uchar obsCol = obsMap.at<uchar>(i, j);
-				if (_environment3D.ptr<double>(i)[j*_environment3D.size[2]+k] == 0){
-					map3d.ptr<uchar>(i)[j*3] = 0;
-					map3d.ptr<uchar>(i)[j*3+1] = 0;//+obsCol;
-					map3d.ptr<uchar>(i)[j*3+2] = 0;
-					break;
-				}
-				else if (_environment3D.ptr<double>(i)[j*_environment3D.size[2]+k] > 0)
-				{
-
-					uchar col = _environment3D.ptr<double>(i)[j*_environment3D.size[2]+k]*intensityEnhance;
-					map3d.ptr<uchar>(i)[j*3] = col;
-					map3d.ptr<uchar>(i)[j*3+1] = col;//+obsCol;
-					map3d.ptr<uchar>(i)[j*3+2] = col;
-					break;
-				}
-			}
+	float intensityEnhance = round(_environment3D.size(0)*_environment3D.size(1)*_environment3D.size(2))*100;//*3;
+	// each column is shown with the mean probability of its voxels, black once it is all observed
+	double columnScale = _envScale/_environment3D.size(2);
+	for (int i = 0; i < _environment3D.size(0); i++){
+		for (int j = 0; j < _environment3D.size(1); j++){
+			// uchar obsCol = obsMap.at<uchar>(i, j);
+			double value = _columnMass.ptr<double>(i)[j]*columnScale;
+			uchar col = (value > 0) ? saturate_cast<uchar>(value*intensityEnhance) : 0;
+			map3d.ptr<uchar>(i)[j*3] = col;
+			map3d.ptr<uchar>(i)[j*3+1] = col;//+obsCol;
+			map3d.ptr<uchar>(i)[j*3+2] = col;
 		}
 	}
 	int robot = _RobConfig.robotRadius/ _voxelSize;
@@ -718,11 +1881,38 @@ void Environment::search()
 	// build a list of all possible pan and tilt angle combinations
 	vector<CameraViewDirection> views = e.buildListOfViewDirections();
 
+	// The saliency of each frame is generated on a separate thread while the next policy is chosen
+	SaliencyProducer saliency([&e](const Mat &frame) { return e.generateSaliencyMap(frame); },
+			config.SalConf.consistency);
+	SaliencyMaps saliencyMaps;
+	int saliencyFrame;
+
+	// Saliency maps of viewpoints that were seen before are taken from the cache
+	SaliencyCache saliencyCache(config.SalConf.cacheBytes, config.SalConf.cachePositionStep,
+			config.SalConf.cacheAngleStep);
+	std::map<int, SaliencyKey> submittedKeys;
+	bool cachedSaliency = false;
+
 	for(int i = 0 ; i < 30;i++)
 	{
 
 		vector<BestPolicy> policy = e.chooseBestAction(views);
 
+		// Collect the saliency map of the last frame according to the consistency policy
+		if (cachedSaliency || saliency.collect(saliencyMaps, saliencyFrame))
+		{
+			if (!cachedSaliency)
+			{
+				if (!saliencyCache.insert(submittedKeys[saliencyFrame], saliencyMaps) && saliencyCache.rejected() == 1)
+					cout << "Saliency maps of " << saliencyMaps.bytes() << " bytes do not fit the cache of "
+							<< config.SalConf.cacheBytes << " bytes\n";
+				submittedKeys.erase(submittedKeys.begin(), submittedKeys.upper_bound(saliencyFrame));
+			}
+			cachedSaliency = false;
+			e.setSaliency(saliencyMaps);
+			// TODO add the saliency map to the search environment
+		}
+
 		if (policy[0].distance > 0)
 		{
 			float robotDirPrev = Environment::keepAngleWithin180(e.getRobotDir());
@@ -739,7 +1929,7 @@ void Environment::search()
 
 			float robotDirNew = Environment::keepAngleWithin180(e.getRobotDir());
 			dirDisplacement = Environment::keepAngleWithin180(robotDirPrev - robotDirNew);
-			e.calculateNewPan(policy[i].direction.Pan, dirDisplacement, robotDirPrev);
+			e.calculateNewPan(policy[0].direction.Pan, dirDisplacement, robotDirPrev);
 
 
 			if (e.getMethod() == SearchConfig::lookMove)
@@ -758,7 +1948,13 @@ void Environment::search()
 
 		String gg = "../testimg.png";
 		_envImage = imread(gg,CV_LOAD_IMAGE_COLOR);
-		generateSaliencyMap();
+		float pan, tilt;
+		e.getPanTilt(pan, tilt);
+		SaliencyKey key = saliencyCache.makeKey(e.getRobotPos(), e.getRobotDir(), pan, tilt, _envImage);
+		if (saliencyCache.lookup(key, saliencyMaps))
+			cachedSaliency = true;
+		else
+			submittedKeys[saliency.submit(_envImage)] = key;
 
 
 		// TODO Perform recognition to look for the object
@@ -772,6 +1968,10 @@ void Environment::search()
 		waitKey(1000);
 
 	}
+	cout << "Saliency cache hits: " << saliencyCache.hits() << " misses: " << saliencyCache.misses()
+			<< " rejected: " << saliencyCache.rejected() << "\n";
+	if (config.SalConf.countAllocations)
+		cout << "Saliency map allocations of the last frame: " << e.getSaliencyAllocations() << "\n";
 }
 int main()
 {
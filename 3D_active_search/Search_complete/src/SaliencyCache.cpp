@@ -0,0 +1,105 @@
+/*
+ *      Author: Amir Rasouli
+ *      email: aras@eecs.yorku.ca
+ *
+ *		Keeps the saliency maps of recent viewpoints so they are not generated again
+ *		when the robot looks at a static scene from the same place
+ *
+ * 	    Copyright 2017 Amir Rasouli
+ *      Licensed under the Simplified BSD License
+ */
+
+#include "SaliencyCache.h"
+
+using namespace cv;
+using namespace std;
+
+size_t SaliencyKeyHash::operator()(const SaliencyKey &key) const
+{
+	size_t h = std::hash<uint64_t>()(key.fingerprint);
+	int fields[] = {key.x, key.y, key.dir, key.pan, key.tilt};
+	for (int i = 0; i < 5; i++)
+		h ^= std::hash<int>()(fields[i]) + 0x9e3779b9 + (h << 6) + (h >> 2);
+	return h;
+}
+
+SaliencyCache::SaliencyCache(size_t maxBytes, double positionStep, double angleStep)
+{
+	_maxBytes = maxBytes;
+	_positionStep = positionStep;
+	_angleStep = angleStep;
+	_bytes = _hits = _misses = _rejected = 0;
+}
+SaliencyKey SaliencyCache::makeKey(cv::Point2d robotPos, float robotDir, float pan, float tilt, const cv::Mat &image) const
+{
+	SaliencyKey key;
+	key.x = cvRound(robotPos.x/_positionStep);
+	key.y = cvRound(robotPos.y/_positionStep);
+	key.dir = cvRound(robotDir/_angleStep);
+	key.pan = cvRound(pan/_angleStep);
+	key.tilt = cvRound(tilt/_angleStep);
+
+	// average hash, one bit per cell brighter than the mean
+	Mat gray, small;
+	if (image.channels() == 3)
+		cvtColor(image, gray, CV_BGR2GRAY);
+	else
+		gray = image;
+	resize(gray, small, Size(8, 8), 0, 0, INTER_AREA);
+	double average = mean(small)[0];
+	key.fingerprint = 0;
+	for (int r = 0; r < 8; r++)
+		for (int c = 0; c < 8; c++)
+			if (small.at<uchar>(r, c) > average)
+				key.fingerprint |= (uint64_t)1 << (r*8 + c);
+	return key;
+}
+// Returns the cached maps of the viewpoint and marks them as most recently used
+bool SaliencyCache::lookup(const SaliencyKey &key, SaliencyMaps &maps)
+{
+	auto it = _index.find(key);
+	if (it == _index.end())
+	{
+		_misses++;
+		return false;
+	}
+	_entries.splice(_entries.begin(), _entries, it->second);
+	maps = it->second->second;
+	_hits++;
+	return true;
+}
+// Adds maps, evicting the least recently used ones to stay within the byte limit. Returns false
+// if the maps alone are larger than the limit.
+bool SaliencyCache::insert(const SaliencyKey &key, const SaliencyMaps &maps)
+{
+	size_t mapBytes = maps.bytes();
+	if (mapBytes > _maxBytes)
+	{
+		_rejected++;
+		return false;
+	}
+
+	auto it = _index.find(key);
+	if (it != _index.end())
+	{
+		_bytes -= it->second->second.bytes();
+		_entries.erase(it->second);
+		_index.erase(it);
+	}
+	while (!_entries.empty() && _bytes + mapBytes > _maxBytes)
+	{
+		_bytes -= _entries.back().second.bytes();
+		_index.erase(_entries.back().first);
+		_entries.pop_back();
+	}
+	_entries.push_front(std::make_pair(key, maps));
+	_index[key] = _entries.begin();
+	_bytes += mapBytes;
+	return true;
+}
+void SaliencyCache::clear()
+{
+	_entries.clear();
+	_index.clear();
+	_bytes = 0;
+}
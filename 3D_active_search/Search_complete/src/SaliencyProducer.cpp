@@ -0,0 +1,106 @@
+/*
+ *      Author: Amir Rasouli
+ *      email: aras@eecs.yorku.ca
+ *
+ *		Runs the saliency generation of the search on a separate thread
+ *
+ * 	    Copyright 2017 Amir Rasouli
+ *      Licensed under the Simplified BSD License
+ */
+
+#include "SaliencyProducer.h"
+
+using namespace cv;
+using namespace std;
+
+SaliencyProducer::SaliencyProducer(Job job, SaliencyConfig::consistencyPolicy policy)
+{
+	_job = job;
+	_policy = policy;
+	_hasPending = _running = _stop = false;
+	_submittedId = _pendingId = _runningId = _resultId = _collectedId = _cancelledId = 0;
+	_worker = std::thread(&SaliencyProducer::run, this);
+}
+SaliencyProducer::~SaliencyProducer()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+	_cond.notify_all();
+	_worker.join();
+}
+// Queues a frame and returns its id. A frame still waiting in the mailbox is dropped.
+int SaliencyProducer::submit(const cv::Mat &frame)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	frame.copyTo(_pending);
+	_hasPending = true;
+	_pendingId = ++_submittedId;
+	_cond.notify_all();
+	return _submittedId;
+}
+// Gets the newest saliency map that was not collected before and returns false if there is none.
+// waitFresh first waits for the last submitted frame, useStale returns what is already finished
+// and cancelStale does the same but also drops the frames that are still waiting or running.
+bool SaliencyProducer::collect(SaliencyMaps &maps, int &frameId)
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	if (_policy == SaliencyConfig::waitFresh)
+		_cond.wait(lock, [this]() { return !_hasPending && !_running; });
+
+	bool fresh = _resultId > _collectedId;
+	if (fresh)
+	{
+		maps = _result;
+		frameId = _collectedId = _resultId;
+	}
+	if (_policy == SaliencyConfig::cancelStale)
+	{
+		_hasPending = false;
+		_cancelledId = _submittedId;
+	}
+	return fresh;
+}
+// Drops the frame waiting in the mailbox and discards the result of the one running
+void SaliencyProducer::cancel()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_hasPending = false;
+	_cancelledId = _submittedId;
+	_cond.notify_all();
+}
+bool SaliencyProducer::busy()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	return _hasPending || _running;
+}
+void SaliencyProducer::run()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	while (true)
+	{
+		_cond.wait(lock, [this]() { return _stop || _hasPending; });
+		if (_stop)
+			break;
+
+		// the frame is swapped out so submit() can fill the mailbox while it is processed
+		std::swap(_pending, _working);
+		_hasPending = false;
+		_running = true;
+		_runningId = _pendingId;
+
+		lock.unlock();
+		SaliencyMaps maps = _job(_working);
+		lock.lock();
+
+		_running = false;
+		// results of cancelled frames are discarded
+		if (_runningId > _cancelledId)
+		{
+			_result = maps;
+			_resultId = _runningId;
+		}
+		_cond.notify_all();
+	}
+}
@@ -26,6 +26,265 @@ using namespace cv;
 using namespace std;
 
 
+// Color spaces that are affine transforms of the BGR input. Each row maps (b, g, r) to one
+// output channel as m*x + bias. When normalization is requested the channel becomes
+// (m*x + bias + normOffset)*normScale, which is folded into a single matrix before conversion.
+struct AffineColorSpace
+{
+	colorSpace type;
+	int channels;
+	bool clampNegative; // clamp negative normalized values to zero
+	float m[3][3];
+	float bias[3];
+	float normOffset[3];
+	float normScale[3];
+};
+
+static constexpr AffineColorSpace affineColorSpaces[] = {
+	{CMY, 3, false,
+		{{0.f, 0.f, -1.f}, {0.f, -1.f, 0.f}, {-1.f, 0.f, 0.f}},
+		{1.f, 1.f, 1.f}, {0.f, 0.f, 0.f}, {1.f, 1.f, 1.f}},
+	// O1 = (R-G)/sqrt(2), O2 = (R+G-2B)/sqrt(6)
+	{COPP, 2, true,
+		{{0.f, -0.70710678f, 0.70710678f}, {-0.81649658f, 0.40824829f, 0.40824829f}, {0.f, 0.f, 0.f}},
+		{0.f, 0.f, 0.f}, {0.70710678f, 0.81649658f, 0.f}, {0.70710678f, 0.61237244f, 1.f}},
+	{XYZ, 3, false,
+		{{0.180423f, 0.357580f, 0.412453f}, {0.072169f, 0.715160f, 0.212671f}, {0.950227f, 0.119193f, 0.019334f}},
+		{0.f, 0.f, 0.f}, {0.f, 0.f, 0.f}, {1.f/0.950456f, 1.f, 1.f/1.088754f}},
+	{YIQ, 3, false,
+		{{0.114f, 0.587f, 0.299f}, {-0.322f, -0.274f, 0.596f}, {-0.312f, -0.523f, 0.211f}},
+		{0.f, 0.f, 0.f}, {0.f, 0.596f, 0.835f}, {1.f, 1.f/1.192f, 1.f/1.046f}},
+	// U = 0.66X, V = Y, W = -0.5X + 1.5Y + 0.5Z applied to the XYZ rows
+	{UVW, 3, false,
+		{{0.66f*0.180423f, 0.66f*0.357580f, 0.66f*0.412453f},
+		 {0.072169f, 0.715160f, 0.212671f},
+		 {-0.5f*0.180423f + 1.5f*0.072169f + 0.5f*0.950227f,
+		  -0.5f*0.357580f + 1.5f*0.715160f + 0.5f*0.119193f,
+		  -0.5f*0.412453f + 1.5f*0.212671f + 0.5f*0.019334f}},
+		{0.f, 0.f, 0.f}, {0.f, 0.f, 0.f}, {1.f/0.66f, 1.f, 1.f/1.569149f}},
+	// U = 0.492(B-Y), V = 0.77(R-Y)
+	{YUV, 3, false,
+		{{0.114f, 0.587f, 0.299f},
+		 {0.492f*(1.f-0.114f), -0.492f*0.587f, -0.492f*0.299f},
+		 {-0.77f*0.114f, -0.77f*0.587f, 0.77f*(1.f-0.299f)}},
+		{0.f, 0.f, 0.f}, {0.f, 0.435912f, 0.53977f}, {1.f, 1.f/0.871824f, 1.f/1.07954f}},
+	// O3 = (R+G+B)/sqrt(3) is divided by 1/sqrt(3) when normalized
+	{OPP, 3, true,
+		{{0.f, -0.70710678f, 0.70710678f}, {-0.81649658f, 0.40824829f, 0.40824829f}, {0.57735027f, 0.57735027f, 0.57735027f}},
+		{0.f, 0.f, 0.f}, {0.70710678f, 0.81649658f, 0.f}, {0.70710678f, 0.61237244f, 1.7320508f}},
+	{YES, 3, false,
+		{{0.063f, 0.684f, 0.253f}, {0.f, -0.5f, 0.5f}, {-0.5f, 0.25f, 0.25f}},
+		{0.f, 0.f, 0.f}, {0.f, 0.5f, 0.5f}, {1.f, 1.f, 1.f}},
+	{I1I2I3, 3, false,
+		{{1.f/3.f, 1.f/3.f, 1.f/3.f}, {-0.5f, 0.f, 0.5f}, {-0.25f, 0.5f, -0.25f}},
+		{0.f, 0.f, 0.f}, {0.f, 0.5f, 0.5f}, {1.f, 1.f, 1.f}}
+};
+
+// Converts a scaled BGR image to one of the affine color spaces in a single transform pass.
+// Returns false if the color space is not affine.
+static bool affineColorConversion(const cv::Mat &scaledImage, cv::Mat &output, colorSpace type, bool norm)
+{
+	for (size_t s = 0; s < sizeof(affineColorSpaces)/sizeof(affineColorSpaces[0]); s++)
+	{
+		const AffineColorSpace &space = affineColorSpaces[s];
+		if (space.type != type)
+			continue;
+
+		float coeffs[3][4];
+		for (int r = 0; r < space.channels; r++)
+		{
+			float offset = norm ? space.normOffset[r] : 0.f;
+			float scale = norm ? space.normScale[r] : 1.f;
+			for (int c = 0; c < 3; c++)
+				coeffs[r][c] = space.m[r][c]*scale;
+			coeffs[r][3] = (space.bias[r] + offset)*scale;
+		}
+		transform(scaledImage, output, Mat(space.channels, 4, CV_32F, coeffs));
+
+		if (norm && space.clampNegative)
+			threshold(output, output, 0, 0, THRESH_TOZERO);
+		return true;
+	}
+	return false;
+}
+
+// Pixel-wise chromaticity normalization, 255*c/(b + g + r) truncated to 8 bits for each channel c.
+// The float path adds 1/2048 to c*(255/sum) before truncating, which reproduces the double precision
+// floor(c/sum*255) for every possible 8-bit pixel. The table path uses the integer reciprocals below.
+#define PIXEL_WISE_EPS (1.f/2048.f)
+#define PIXEL_WISE_SHIFT 20
+
+// ceil((255 << PIXEL_WISE_SHIFT)/sum) for every channel sum of an 8-bit BGR pixel
+struct PixelWiseTable
+{
+	unsigned int recip[766];
+	PixelWiseTable()
+	{
+		recip[0] = 0;
+		for (unsigned int s = 1; s < 766; s++)
+			recip[s] = ((255u << PIXEL_WISE_SHIFT) + s - 1)/s;
+	}
+};
+
+#if CV_SIMD128
+static inline void pixelWiseReciprocal(const v_uint16x8 &sum, v_float32x4 &lo, v_float32x4 &hi)
+{
+	v_uint32x4 s0, s1;
+	v_expand(sum, s0, s1);
+	v_float32x4 one = v_setall_f32(1.f), k = v_setall_f32(255.f);
+	lo = k / v_max(v_cvt_f32(v_reinterpret_as_s32(s0)), one);
+	hi = k / v_max(v_cvt_f32(v_reinterpret_as_s32(s1)), one);
+}
+static inline v_int16x8 pixelWiseScale(const v_uint16x8 &channel, const v_float32x4 &lo, const v_float32x4 &hi)
+{
+	v_uint32x4 c0, c1;
+	v_expand(channel, c0, c1);
+	v_float32x4 eps = v_setall_f32(PIXEL_WISE_EPS);
+	return v_pack(v_trunc(v_cvt_f32(v_reinterpret_as_s32(c0))*lo + eps),
+			v_trunc(v_cvt_f32(v_reinterpret_as_s32(c1))*hi + eps));
+}
+#endif
+
+// Normalizes a range of rows of an 8-bit BGR image. dst may be the same image as src.
+class PixelWiseNormalizer : public cv::ParallelLoopBody
+{
+public:
+	PixelWiseNormalizer(const cv::Mat &src, cv::Mat &dst, const unsigned int *recip = NULL)
+	: src(src), dst(dst), recip(recip) {}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		for (int i = range.start; i < range.end; i++)
+		{
+			const uchar* s = src.ptr<uchar>(i);
+			uchar* d = dst.ptr<uchar>(i);
+			if (recip)
+				tableRow(s, d, src.cols);
+			else
+				floatRow(s, d, src.cols);
+		}
+	}
+
+private:
+	void floatRow(const uchar* src, uchar* dst, int cols) const
+	{
+		int j = 0;
+#if CV_SIMD128
+		for (; j <= cols - 16; j += 16)
+		{
+			v_uint8x16 b, g, r;
+			v_uint16x8 b0, b1, g0, g1, r0, r1;
+			v_float32x4 rcp0, rcp1, rcp2, rcp3;
+			v_load_deinterleave(src + j*3, b, g, r);
+			v_expand(b, b0, b1);
+			v_expand(g, g0, g1);
+			v_expand(r, r0, r1);
+			pixelWiseReciprocal(b0 + g0 + r0, rcp0, rcp1);
+			pixelWiseReciprocal(b1 + g1 + r1, rcp2, rcp3);
+			b = v_pack_u(pixelWiseScale(b0, rcp0, rcp1), pixelWiseScale(b1, rcp2, rcp3));
+			g = v_pack_u(pixelWiseScale(g0, rcp0, rcp1), pixelWiseScale(g1, rcp2, rcp3));
+			r = v_pack_u(pixelWiseScale(r0, rcp0, rcp1), pixelWiseScale(r1, rcp2, rcp3));
+			v_store_interleave(dst + j*3, b, g, r);
+		}
+#endif
+		for (; j < cols; j++)
+		{
+			int b = src[j*3], g = src[j*3+1], r = src[j*3+2];
+			float rcp = 255.f/max(b + g + r, 1);
+			dst[j*3] = (uchar)(b*rcp + PIXEL_WISE_EPS);
+			dst[j*3+1] = (uchar)(g*rcp + PIXEL_WISE_EPS);
+			dst[j*3+2] = (uchar)(r*rcp + PIXEL_WISE_EPS);
+		}
+	}
+	void tableRow(const uchar* src, uchar* dst, int cols) const
+	{
+		for (int j = 0; j < cols*3; j += 3)
+		{
+			unsigned int b = src[j], g = src[j+1], r = src[j+2];
+			unsigned int k = recip[b + g + r];
+			dst[j] = (uchar)((b*k) >> PIXEL_WISE_SHIFT);
+			dst[j+1] = (uchar)((g*k) >> PIXEL_WISE_SHIFT);
+			dst[j+2] = (uchar)((r*k) >> PIXEL_WISE_SHIFT);
+		}
+	}
+
+	const cv::Mat &src;
+	cv::Mat &dst;
+	const unsigned int *recip;
+};
+
+// Accumulates a 256-bin histogram of all the elements of a range of rows of an 8-bit image
+class ByteHistogram : public cv::ParallelLoopBody
+{
+public:
+	ByteHistogram(const cv::Mat &src, unsigned int *hist, cv::Mutex &mutex)
+	: src(src), hist(hist), mutex(mutex) {}
+
+	virtual void operator()(const cv::Range &range) const
+	{
+		unsigned int local[256] = {};
+		int width = src.cols*src.channels();
+		for (int i = range.start; i < range.end; i++)
+		{
+			const uchar* s = src.ptr<uchar>(i);
+			for (int j = 0; j < width; j++)
+				local[s[j]]++;
+		}
+		cv::AutoLock lock(mutex);
+		for (int v = 0; v < 256; v++)
+			hist[v] += local[v];
+	}
+
+private:
+	const cv::Mat &src;
+	unsigned int *hist;
+	cv::Mutex &mutex;
+};
+
+// Value of the element with the given rank (0 is the smallest) from a 256-bin histogram
+static int histogramRank(const unsigned int *hist, int rank)
+{
+	unsigned int count = 0;
+	for (int v = 0; v < 256; v++)
+	{
+		count += hist[v];
+		if (count > (unsigned int)rank)
+			return v;
+	}
+	return 255;
+}
+
+// Value at the given percentile of all the elements of map, interpolated between the two closest
+// ranks the same way as reading them from the sorted map. 8-bit maps are ranked with a histogram
+// and other maps with a partial sort in buffer. Ranks outside the map are clamped to it.
+static float percentileValue(const cv::Mat &map, double percentile, cv::Mat &buffer)
+{
+	float ip, fPart, kPart, h, g;
+	int n = map.rows*map.cols*map.channels();
+	if (n == 0)
+		return 0.f;
+	ip = (percentile/100)*(n+1);//(percentile*n)/100 + 0.5;
+	fPart = modf(ip, &kPart);
+	int lo = min(max((int)kPart - 1, 0), n - 1);
+	int hi = min(max((int)kPart, 0), n - 1);
+
+	if (map.depth() == CV_8U)
+	{
+		unsigned int hist[256] = {};
+		cv::Mutex mutex;
+		parallel_for_(Range(0, map.rows), ByteHistogram(map, hist, mutex));
+		h = histogramRank(hist, lo);
+		g = histogramRank(hist, hi);
+	}else
+	{
+		map.convertTo(buffer, CV_32F);
+		float* values = buffer.ptr<float>();
+		std::nth_element(values, values + lo, values + n);
+		h = values[lo];
+		g = (hi > lo) ? *std::min_element(values + hi, values + n) : h;
+	}
+	return (1 - fPart)*h + fPart*g;
+}
 
 Saliency::Saliency()
 {
@@ -59,31 +318,16 @@ void Saliency::resetAIM()
 // Pixel-wise normalizes an image
 cv::Mat Saliency::normalizeImage(cv::Mat RGBImage)
 {
-	Mat rgbImg = RGBImage.clone();
-
-	double intensity = 0.;
-	double nR = 0.;
-	double nG = 0.;
-	double nB = 0.;
-
-	for (int i = 0; i < rgbImg.rows; i++){
-		for (int j = 0; j < rgbImg.cols ; j++){
-			intensity = rgbImg.at<Vec3b>(i,j)[0] + rgbImg.at<Vec3b>(i,j)[1] + rgbImg.at<Vec3b>(i,j)[2];
-			if (intensity == 0.){
-				intensity = 1/sqrt((double)3);
-			}
-			nB = rgbImg.at<Vec3b>(i,j)[0]/intensity;
-			nG = rgbImg.at<Vec3b>(i,j)[1]/intensity;
-			nR = rgbImg.at<Vec3b>(i,j)[2]/intensity;
-			rgbImg.at<Vec3b>(i,j)[0] = floor(nB*255);
-			rgbImg.at<Vec3b>(i,j)[1] = floor(nG*255);
-			rgbImg.at<Vec3b>(i,j)[2] = floor(nR*255);
-		}
-	}
-
-
+	Mat rgbImg;
+	normalizeImage(RGBImage, rgbImg);
 	return rgbImg ;
-
+}
+// Same as above but writes into output, which is reused when its size and type match.
+// output may be the input image.
+void Saliency::normalizeImage(const cv::Mat &RGBImage, cv::Mat &output)
+{
+	output.create(RGBImage.rows, RGBImage.cols, CV_8UC3);
+	parallel_for_(Range(0, RGBImage.rows), PixelWiseNormalizer(RGBImage, output));
 }
 // Normalizes the color histogram
 void Saliency::normalizeHistogram(cv::Mat &histogram)
@@ -99,139 +343,109 @@ void Saliency::normalizeHistogram(cv::Mat &histogram)
 cv::Mat Saliency::percentileThreshold(cv::Mat salMap, double percentile)
 {
 	Mat salMapBinary;
-	Mat map = salMap.clone();
-	Mat vectorizedMap = map.reshape(1,1);
-	cv::sort(vectorizedMap , vectorizedMap , CV_SORT_ASCENDING);
-	float ip, xInt, fPart, kPart;
-	int n = vectorizedMap.cols;
-	ip = (percentile/100)*(n+1);//(percentile*n)/100 + 0.5;
-	fPart = modf(ip, &kPart);
-	int h = (int)vectorizedMap.at<uchar>(0, kPart-1);
-	int g = (int)vectorizedMap.at<uchar>(0, kPart);
-	xInt = (1 - fPart)*h +fPart *g;
+	float xInt = percentileValue(salMap, percentile, percentileBuffer);
 	threshold(salMap, salMapBinary, (double)xInt, 255, THRESH_TOZERO);
 	return salMapBinary;
 }
 // Converts an RGB input image to 20 different color spaces
 cv::Mat Saliency::imageConversion(cv::Mat inputImg, colorSpace type, bool norm)
 {
+	ConversionWorkspace ws;
 	Mat output;
-	vector<Mat> channels, HSIChannels, CMYChannels(3), C1C2C3Channels(3),
-			O1O2Channels(2), YIQChannels(3), UVWChannels(3), YUVChannels(3),
-			xyYChannels(3), OPPChannels(3), rgChannels(2), YESChannels(3), I3Channels(3);
-	Mat t, I, S, scaledImage, onesMat;
-	Mat Y, C, C1, C2, H, O3;
-	vector<double> mean, dev;
-	int index = type;
-
-	inputImg.convertTo(scaledImage, CV_32FC3);
-	scaledImage *= 1.f/255.f;
-	cout << "Convert To color space: " << _colors[index] << "\n";
+	imageConversion(inputImg, output, type, ws, norm);
+	return output;
+}
+
+// Same as above but writes into output and keeps all temporaries in ws, so repeated calls
+// with images of the same size do not allocate. output may be the input image.
+void Saliency::imageConversion(const cv::Mat &inputImg, cv::Mat &output, colorSpace type, ConversionWorkspace &ws, bool norm)
+{
+	if (type == colorSpace::RGB || type < colorSpace::RGB || type > colorSpace::I1I2I3)
+	{
+		inputImg.convertTo(output, CV_32FC3, 1.f/255.f);
+		return;
+	}
+
+	inputImg.convertTo(ws.scaled, CV_32FC3, 1.f/255.f);
+	cout << "Convert To color space: " << _colors[type] << "\n";
+	const Mat &scaledImage = ws.scaled;
+	int rows = scaledImage.rows, cols = scaledImage.cols;
 
 	switch (type){
 	//******************* HSV****************
 	case colorSpace::HSV:
-		cvtColor(scaledImage, output, CV_BGR2HSV);
 		if (norm){
-			split(output, channels);
-			channels[0]/=360;
-			merge(channels,output);
+			const float hsv[3][4] = {{1.f/360.f, 0, 0, 0}, {0, 1.f, 0, 0}, {0, 0, 1.f, 0}};
+			cvtColor(scaledImage, ws.converted, CV_BGR2HSV);
+			transform(ws.converted, output, Mat(3, 4, CV_32F, (void*)hsv));
+		}else
+		{
+			cvtColor(scaledImage, output, CV_BGR2HSV);
 		}
-
 		break;
 
 		//******************* HSL****************
 	case colorSpace::HSL:
-		cvtColor(scaledImage, output, CV_BGR2HLS);
-		split(output, channels);
-		t = channels[1].clone();
-		channels[1] = channels[2].clone();
-		channels[2] = t.clone();
-
-		if(norm){
-			channels[0]/=360;
-		}
-
-		merge(channels, output);
+	{
+		// HLS to HSL is a channel swap
+		float hue = norm ? 1.f/360.f : 1.f;
+		const float hsl[3][4] = {{hue, 0, 0, 0}, {0, 0, 1.f, 0}, {0, 1.f, 0, 0}};
+		cvtColor(scaledImage, ws.converted, CV_BGR2HLS);
+		transform(ws.converted, output, Mat(3, 4, CV_32F, (void*)hsl));
 		break;
+	}
 
 		//******************* HSI****************
 	case colorSpace::HSI:
-		cvtColor(scaledImage, t, CV_BGR2HLS);
-		split(scaledImage, channels);
-
-		I = 1.f/3.f * (channels[0] + channels[1]+ channels[2]);
-		S = Mat(channels[0].rows, channels[0].cols, CV_32F); // s in [0,1]
-		//.ptr<t>(rows)[cols*3]
-		//.ptr<t>(i)[j*3+1]
-		//.ptr<t>(i)[j*3+2]
-		for (int i = 0; i < S.rows; i++)
-			for(int j = 0; j< S.cols; j++)
-			{
-				float r = channels[2].at<float>(i,j);
-				float g = channels[1].at<float>(i,j);
-				float b = channels[0].at<float>(i,j);
-
-				if (max(g,max(r,b)) != 0)
-				{
-					S.at<float>(i,j) = 1 - min(g,min(r,b))/I.at<float>(i,j);
-
-				}else
-				{
-					S.at<float>(i,j) = 0.f;
-				}
-			}
-
-		split(t, HSIChannels);
-		HSIChannels[1] = S;
-		HSIChannels[2] = I;
+	{
+		cvtColor(scaledImage, ws.converted, CV_BGR2HLS);
+		output.create(rows, cols, CV_32FC3);
+		float hue = norm ? 1.f/360.f : 1.f;
 
-		if(norm)
+		for (int i = 0; i < rows; i++)
 		{
-			HSIChannels[0]/=360.f;
+			const float* bgr = scaledImage.ptr<float>(i);
+			const float* hls = ws.converted.ptr<float>(i);
+			float* hsi = output.ptr<float>(i);
+			for(int j = 0; j < cols*3; j += 3)
+			{
+				float b = bgr[j];
+				float g = bgr[j+1];
+				float r = bgr[j+2];
+				float I = 1.f/3.f * (b + g + r);
+
+				hsi[j] = hls[j]*hue;
+				hsi[j+1] = (max(g,max(r,b)) != 0) ? 1 - min(g,min(r,b))/I : 0.f; // s in [0,1]
+				hsi[j+2] = I;
+			}
 		}
-
-		merge(HSIChannels, output);
-		break;
-
-		//******************* CMY****************
-	case colorSpace::CMY:
-		split(scaledImage, channels);
-		onesMat = Mat(scaledImage.rows, scaledImage.cols,CV_32F, Scalar::all(1));
-		CMYChannels[0] = onesMat - channels[2];
-		CMYChannels[1] = onesMat - channels[1];
-		CMYChannels[2] = onesMat - channels[0];
-		merge(CMYChannels, output);
 		break;
+	}
 
 		//******************* Lab****************
 	case colorSpace::Lab:
-		cvtColor(scaledImage , output , CV_BGR2Lab);
-
 		if (norm)
 		{
-			split(output, channels);
-			channels[0]/=100.f;
-			channels[1] = (channels[1] + 127.f)/254.f;
-			channels[2] = (channels[2] + 127.f)/254.f;
-			merge(channels, output);
+			const float lab[3][4] = {{1.f/100.f, 0, 0, 0}, {0, 1.f/254.f, 0, 127.f/254.f}, {0, 0, 1.f/254.f, 127.f/254.f}};
+			cvtColor(scaledImage , ws.converted , CV_BGR2Lab);
+			transform(ws.converted, output, Mat(3, 4, CV_32F, (void*)lab));
+		}else
+		{
+			cvtColor(scaledImage , output , CV_BGR2Lab);
 		}
-
 		break;
 
 		//******************* Luv ****************
 	case colorSpace::Luv:
-		cvtColor(scaledImage , output , CV_BGR2Luv);
-
 		if (norm)
 		{
-			split(output, channels);
-			channels[0]/=100.f;
-			channels[1] = (channels[1] + 134.f)/354.f;
-			channels[2] = (channels[2] + 140.f)/262.f;
-			merge(channels, output);
+			const float luv[3][4] = {{1.f/100.f, 0, 0, 0}, {0, 1.f/354.f, 0, 134.f/354.f}, {0, 0, 1.f/262.f, 140.f/262.f}};
+			cvtColor(scaledImage , ws.converted , CV_BGR2Luv);
+			transform(ws.converted, output, Mat(3, 4, CV_32F, (void*)luv));
+		}else
+		{
+			cvtColor(scaledImage , output , CV_BGR2Luv);
 		}
-
 		break;
 
 		//******************* YCrCb ****************
@@ -241,200 +455,110 @@ cv::Mat Saliency::imageConversion(cv::Mat inputImg, colorSpace type, bool norm)
 
 		//******************* C1C2C3 ****************
 	case colorSpace::C1C2C3:
-		split(scaledImage, channels);
-		C1C2C3Channels[0] = Mat(scaledImage.rows, scaledImage.cols,CV_32F);
-		C1C2C3Channels[1] = Mat(scaledImage.rows, scaledImage.cols,CV_32F);
-		C1C2C3Channels[2] = Mat(scaledImage.rows, scaledImage.cols,CV_32F);
-
-		for (int i = 0; i < scaledImage.rows; i++)
-			for(int j = 0; j < scaledImage.cols; j++)
-			{
-				float r = channels[2].at<float>(i,j);
-				float g = channels[1].at<float>(i,j);
-				float b = channels[0].at<float>(i,j);
-
-				C1C2C3Channels[0].at<float>(i,j) = atan2(r,max(g,b));
-				C1C2C3Channels[1].at<float>(i,j) = atan2(g,max(r,b));
-				C1C2C3Channels[2].at<float>(i,j) = atan2(b,max(g,r));
-			}
-
-		if (norm)
-		{
-			C1C2C3Channels[0] = (C1C2C3Channels[0]+PI/2.f)/PI;
-			C1C2C3Channels[1] = (C1C2C3Channels[1]+PI/2.f)/PI;
-			C1C2C3Channels[2] = (C1C2C3Channels[2]+PI/2.f)/PI;
-		}
-
-		merge(C1C2C3Channels, output);
-		break;
-
-		//******************* COPP ****************
-	case colorSpace::COPP:
-		split(scaledImage, channels);
-		O1O2Channels[0] = (channels[2]-channels[1])/sqrt(2.f);
-		O1O2Channels[1] = (channels[2]+channels[1]-2.f*channels[0])/sqrt(6.f);
-
-		if (norm)
-		{
-			float denom = 1.f/sqrt(2.f);
-			float denom2 = 2.f/sqrt(6.f);
-			O1O2Channels[0] = (O1O2Channels[0]+denom )/(denom*2.f);
-			threshold( O1O2Channels[0], O1O2Channels[0], 0, 0,THRESH_TOZERO);
-
-			O1O2Channels[1] = (O1O2Channels[1]+denom2 )/(denom2*2.f);
-			threshold( O1O2Channels[1], O1O2Channels[1], 0, 0,THRESH_TOZERO);
-		}
-
-		merge(O1O2Channels, output);
-		break;
-
-		//******************* XYZ ****************
-	case colorSpace::XYZ:
-
-		cvtColor(scaledImage , output , CV_BGR2XYZ);
-
-		if (norm)
-		{
-			split(output, channels);
-			channels[0] /= 0.950456f;
-			channels[2] /= 1.088754f ;
-			merge(channels, output);
-		}
-
-		break;
-
-		//******************* YIQ ****************
-	case colorSpace::YIQ:
-		split(scaledImage, channels);
-		YIQChannels[0] = 0.299f*channels[2] + 0.587f*channels[1] + 0.114f*channels[0];
-		YIQChannels[1] = 0.596f*channels[2] - 0.274f*channels[1] - 0.322f*channels[0];
-		YIQChannels[2] = 0.211f*channels[2] - 0.523f*channels[1] - 0.312f*channels[0];
-
-		if (norm)
-		{
-			YIQChannels[1]  = (YIQChannels[1] + 0.596f)/(1.192f);
-			YIQChannels[2]  = (YIQChannels[2] + 0.835f)/(1.046f);
-		}
-
-		merge(YIQChannels, output);
-		break;
-
-		//*******************  UVW ****************
-	case colorSpace::UVW:
-		cvtColor(scaledImage , t , CV_BGR2XYZ);
-		split(t, channels);
-		UVWChannels[0] = 0.66f*channels[0];
-		UVWChannels[1] = channels[1];
-		UVWChannels[2] = -0.5f*channels[0] + 1.5f*channels[1] + 0.5f*channels[2];
-
-		if (norm)
-		{
-			UVWChannels[0] /= 0.66f;
-			UVWChannels[2] /= 1.569149f;
-		}
-
-		merge(UVWChannels, output);
-		break;
-		//******************* YUV ****************
-	case colorSpace::YUV:
-		split(scaledImage, channels);
-		YUVChannels[0] = 0.299f*channels[2] + 0.587f*channels[1] + 0.114f*channels[0];
-		YUVChannels[1] = 0.492f*(channels[0]-YUVChannels[0]);
-		YUVChannels[2] = 0.77f*(channels[2]-YUVChannels[0]);
+		output.create(rows, cols, CV_32FC3);
 
-		if (norm)
+		for (int i = 0; i < rows; i++)
 		{
-			YUVChannels[1]  = (YUVChannels[1] + 0.435912f)/(0.871824f);
-			YUVChannels[2]  = (YUVChannels[2] + 0.53977f)/(1.07954f);
-		}
-
-		merge(YUVChannels, output);
-		break;
+			const float* bgr = scaledImage.ptr<float>(i);
+			float* c = output.ptr<float>(i);
+			for(int j = 0; j < cols*3; j += 3)
+			{
+				float b = bgr[j];
+				float g = bgr[j+1];
+				float r = bgr[j+2];
 
-		//******************* OPP ****************
-	case colorSpace::OPP:
-		split(scaledImage, channels);
-		OPPChannels[0] = (channels[2] - channels[1])/sqrt(2.f);
-		OPPChannels[1] = (channels[2] + channels[1]-2.f*channels[0])/sqrt(6.f);
-		OPPChannels[2] = (channels[0] + channels[1]+channels[2])/sqrt(3.f);
+				c[j] = atan2(r,max(g,b));
+				c[j+1] = atan2(g,max(r,b));
+				c[j+2] = atan2(b,max(g,r));
 
-		if (norm)
-		{
-			float denom = 1.f/sqrt(2.f);
-			float denom2 = 2.f/sqrt(6.f);
-			OPPChannels[0] = (OPPChannels[0]+denom )/(denom*2.f);
-			threshold(OPPChannels[0],OPPChannels[0], 0, 0,THRESH_TOZERO);
-			OPPChannels[1] = (OPPChannels[1]+denom2 )/(denom2*2.f);
-			threshold(OPPChannels[1],OPPChannels[1], 0, 0,THRESH_TOZERO);
-			OPPChannels[2] /= 1.f/sqrt(3.f);
+				if (norm)
+				{
+					c[j] = (c[j]+PI/2.f)/PI;
+					c[j+1] = (c[j+1]+PI/2.f)/PI;
+					c[j+2] = (c[j+2]+PI/2.f)/PI;
+				}
+			}
 		}
-
-		merge(OPPChannels, output);
 		break;
 
 		//******************* NOPP ****************
 	case colorSpace::NOPP:
-		split(scaledImage, channels);
-		O3 = (channels[0] + channels[1] + channels[2])/sqrt(3.f);
-		O1O2Channels[0] = (channels[2]-channels[1])/sqrt(2.f);
-		divide(O1O2Channels[0], O3,O1O2Channels[0]);
-		O1O2Channels[1] = (channels[2]+channels[1]-2.f*channels[0])/sqrt(6.f);
-		divide(O1O2Channels[1], O3 ,O1O2Channels[1]);
+	{
+		float denom1_1 = sqrt(3.f)/(sqrt(2.f));
+		float denom1_2 = denom1_1*2.f;
+		float denom2_1 = 2.f*sqrt(3.f)/sqrt(6.f);
+		float denom2_2 =  denom2_1 + sqrt(3.f)/sqrt(6.f);
+		output.create(rows, cols, CV_32FC2);
 
-		if (norm)
+		for (int i = 0; i < rows; i++)
 		{
-			float denom1_1 = sqrt(3.f)/(sqrt(2.f));
-			float denom1_2 = denom1_1*2.f;
-			float denom2_1 = 2.f*sqrt(3.f)/sqrt(6.f);
-			float denom2_2 =  denom2_1 + sqrt(3.f)/sqrt(6.f);
-
-			O1O2Channels[0] = (O1O2Channels[0] + denom1_1) / denom1_2;
-			threshold(O1O2Channels[0],O1O2Channels[0], 0, 0,THRESH_TOZERO);
-			O1O2Channels[1] = (O1O2Channels[1] + denom2_1) / denom2_2;
-			threshold(O1O2Channels[1],O1O2Channels[1], 0, 0,THRESH_TOZERO);
+			const float* bgr = scaledImage.ptr<float>(i);
+			float* o = output.ptr<float>(i);
+			for(int j = 0; j < cols; j++)
+			{
+				float b = bgr[j*3];
+				float g = bgr[j*3+1];
+				float r = bgr[j*3+2];
+				float O3 = (b + g + r)/sqrt(3.f);
+				float O1 = (r - g)/sqrt(2.f);
+				float O2 = (r + g - 2.f*b)/sqrt(6.f);
+				O1 = (O3 != 0) ? O1/O3 : 0.f;
+				O2 = (O3 != 0) ? O2/O3 : 0.f;
+
+				if (norm)
+				{
+					O1 = (O1 + denom1_1) / denom1_2;
+					O2 = (O2 + denom2_1) / denom2_2;
+					O1 = (O1 > 0) ? O1 : 0.f;
+					O2 = (O2 > 0) ? O2 : 0.f;
+				}
+				o[j*2] = O1;
+				o[j*2+1] = O2;
+			}
 		}
-
-		merge(O1O2Channels, output);
 		break;
+	}
 
 		//******************* xyY ****************
 	case colorSpace::xyY:
-		cvtColor(scaledImage , t , CV_BGR2XYZ);
-		split(t, channels);
-		divide(channels[0],channels[0]+channels[1]+channels[2], xyYChannels[0]);
-		divide(channels[1],channels[0]+channels[1]+channels[2], xyYChannels[1]);
-		xyYChannels[2] = channels[1];
+		affineColorConversion(scaledImage, ws.converted, colorSpace::XYZ, false);
+		output.create(rows, cols, CV_32FC3);
 
-		if(norm)
+		for (int i = 0; i < rows; i++)
 		{
-			xyYChannels[0] = xyYChannels[0] / 0.639999814f ;
-			xyYChannels[1] = xyYChannels[1] / 0.6f;
-		}
+			const float* XYZ = ws.converted.ptr<float>(i);
+			float* xyY = output.ptr<float>(i);
+			for(int j = 0; j < cols*3; j += 3)
+			{
+				float s = XYZ[j] + XYZ[j+1] + XYZ[j+2];
+				xyY[j] = (s != 0) ? XYZ[j]/s : 0.f;
+				xyY[j+1] = (s != 0) ? XYZ[j+1]/s : 0.f;
+				xyY[j+2] = XYZ[j+1];
 
-		merge(xyYChannels, output);
+				if(norm)
+				{
+					xyY[j] = xyY[j] / 0.639999814f;
+					xyY[j+1] = xyY[j+1] / 0.6f;
+				}
+			}
+		}
 		break;
 
 		//******************* rg ****************
 	case colorSpace::rg:
-		split(scaledImage, channels);
-		divide(channels[2],channels[0]+channels[1]+channels[2],rgChannels[0]);
-		divide(channels[1],channels[0]+channels[1]+channels[2],rgChannels[1]);
-		merge(rgChannels,output);
-		break;
+		output.create(rows, cols, CV_32FC2);
 
-		//******************* YES ****************
-	case colorSpace::YES:
-		split(scaledImage, channels);
-		YESChannels[0] = 0.253f*channels[2] + 0.684f*channels[1] + 0.063f*channels[0];
-		YESChannels[1] = 0.5f*channels[2] - 0.5f*channels[1];
-		YESChannels[2] = 0.250f*channels[2] + 0.250f*channels[1] - 0.5f*channels[0];
-		if(norm)
+		for (int i = 0; i < rows; i++)
 		{
-			YESChannels[1] += 0.5f;
-			YESChannels[2] += 0.5f;
+			const float* bgr = scaledImage.ptr<float>(i);
+			float* rg = output.ptr<float>(i);
+			for(int j = 0; j < cols; j++)
+			{
+				float s = bgr[j*3] + bgr[j*3+1] + bgr[j*3+2];
+				rg[j*2] = (s != 0) ? bgr[j*3+2]/s : 0.f;
+				rg[j*2+1] = (s != 0) ? bgr[j*3+1]/s : 0.f;
+			}
 		}
-
-		merge(YESChannels,output);
 		break;
 
 		//		//******************* TRGB ****************
@@ -448,32 +572,10 @@ cv::Mat Saliency::imageConversion(cv::Mat inputImg, colorSpace type, bool norm)
 		//		merge(channels, output);
 		//		break;
 
-
-	case colorSpace::I1I2I3:
-		split(scaledImage, channels);
-
-		I3Channels[0] = (channels[0]+channels[1]+channels[2])/3.f;
-		I3Channels[1] = (channels[2] - channels[0])/2.f;
-		I3Channels[2] = (2*channels[1] - channels[2] -channels[0])/4.f;
-
-		if(norm)
-		{
-			I3Channels[1] += 0.5f;
-			I3Channels[2] += 0.5f;
-		}
-
-		merge(I3Channels, output);
-		break;
-
-	case colorSpace::RGB:
-		output = scaledImage.clone();
-		break;
-
+		//******************* CMY, COPP, XYZ, YIQ, UVW, YUV, OPP, YES, I1I2I3 ****************
 	default:
-		output = scaledImage.clone();
+		affineColorConversion(scaledImage, output, type, norm);
 		break;
-
-		return output;
 	}
 }
 // Generates a ROS sensor message using an image
@@ -509,6 +611,12 @@ cv::Mat Saliency::getImageFromMsg( sensor_msgs::Image msg)
 // Generates a top-down saliency using backprojection. Image: input image, temp : object template.
 // To set the parameters please refer to opencv documentation
 cv::Mat Saliency::generateBackProjection(cv::Mat imageCV, cv::Mat temp)
+{
+	Mat backProjectedImage;
+	generateBackProjection(imageCV, temp, backProjectedImage);
+	return backProjectedImage;
+}
+void Saliency::generateBackProjection(const cv::Mat &imageCV, const cv::Mat &temp, cv::Mat &backProjectedImage)
 {
 	int channels [] = {0,1,2,3};
 	int dim = imageCV.channels();
@@ -516,19 +624,13 @@ cv::Mat Saliency::generateBackProjection(cv::Mat imageCV, cv::Mat temp)
 	float range[] = {0, 1.001};
 	const float* ranges[] = {range, range ,range,range};
 
-	Mat templateHistogram;
+	calcHist(&temp,1,channels,Mat(),bpHistogram, dim, histSize, ranges, true, false);
+	normalizeHistogram(bpHistogram);
 
-	calcHist(&temp,1,channels,Mat(),templateHistogram, dim, histSize, ranges, true, false);
-	normalizeHistogram(templateHistogram);
-
-	Mat backProjectedImage;
-	calcBackProject(&imageCV, 1, channels, templateHistogram, backProjectedImage, ranges, 1, true );
-
-	threshold(backProjectedImage, backProjectedImage, 0,255,THRESH_BINARY);
-	backProjectedImage.convertTo(backProjectedImage, CV_8UC1);
-
-	return backProjectedImage;
+	calcBackProject(&imageCV, 1, channels, bpHistogram, bpProjection, ranges, 1, true );
 
+	threshold(bpProjection, bpProjection, 0,255,THRESH_BINARY);
+	bpProjection.convertTo(backProjectedImage, CV_8UC1);
 }
 /* Load basis from a binary file
  * Expects the binary file to be formatted as follows:
@@ -673,18 +775,21 @@ bool Saliency::GetBackProjMap(saliency::GetBackProj::Request& req, saliency::Get
 	{
 		this->num_bins = req.num_bins;
 	}
-	tempImg = normalizeImage(tempImg);
+	normalizeImage(tempImg, bpNormTemplate);
 	if (req.normalize)
 	{
-		imageInput = normalizeImage(imageInput);
+		normalizeImage(imageInput, bpNormImage);
+	}else
+	{
+		bpNormImage = imageInput;
 	}
 	std::vector<string>::iterator it;
 	it = find (_colors.begin(), _colors.end(), req.color_space);
-	int pos = it - _colors.begin();
-	imageInput = imageConversion(imageInput, static_cast<colorSpace>(pos));
-	tempImg  = imageConversion(tempImg , static_cast<colorSpace>(pos));
-	Mat backprojImg = generateBackProjection(imageInput,tempImg);
-	res.backproj_image = fillImageMsgs(backprojImg,"bpImg_c" + req.color_space + "_b" + to_string(this->num_bins));
+	colorSpace space = static_cast<colorSpace>(it - _colors.begin());
+	imageConversion(bpNormImage, bpImage, space, workspace);
+	imageConversion(bpNormTemplate, bpTemplate, space, workspace);
+	generateBackProjection(bpImage, bpTemplate, bpResult);
+	res.backproj_image = fillImageMsgs(bpResult,"bpImg_c" + req.color_space + "_b" + to_string(this->num_bins));
 
 
 	return true;
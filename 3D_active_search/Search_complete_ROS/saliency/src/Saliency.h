@@ -3,6 +3,7 @@
 #include <sstream>
 #include <opencv2/opencv.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/core/hal/intrin.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <sensor_msgs/Image.h>
 #include "std_msgs/Float32.h"
@@ -25,6 +26,14 @@ enum colorSpace {RGB=0, HSV, Lab, Luv, HSI, HSL, CMY, C1C2C3, COPP, YCrCb, YIQ,
     OPP, NOPP, xyY, rg, YES, I1I2I3};
 #define PI 3.14159265359
 #define SQR(X) ((X)*(X))
+
+//Scratch buffers reused by the conversion routines between calls
+struct ConversionWorkspace
+{
+	cv::Mat scaled, converted;
+	std::vector<cv::Mat> planes;
+};
+
 class Saliency
 {
 public:
@@ -33,12 +42,16 @@ public:
 	void resetAIM();
 	//****************************** Utilities ******************************
 	cv::Mat imageConversion(cv::Mat inputImg,colorSpace type, bool norm = true);
+	void imageConversion(const cv::Mat &inputImg, cv::Mat &output, colorSpace type,
+			ConversionWorkspace &ws, bool norm = true);
 	cv::Mat normalizeImage(cv::Mat RGBImage);
+	void normalizeImage(const cv::Mat &RGBImage, cv::Mat &output);
 	void normalizeHistogram(cv::Mat &histogram);
 	cv::Mat percentileThreshold(cv::Mat salMap, double percentile);
 
 	//****************************** Methods ******************************
 	cv::Mat generateBackProjection(cv::Mat image, cv::Mat temp);
+	void generateBackProjection(const cv::Mat &image, const cv::Mat &temp, cv::Mat &backProjectedImage);
 
 	void loadBasis(std::string filename = "../21infomax950.bin");
 	cv::Mat runAIM();
@@ -63,7 +76,7 @@ private:
 	float* data;
 	float scale;
 	std::vector<cv::Mat> channels;
-	cv::Mat image, temp, sm, hist;
+	cv::Mat image, temp, sm, hist, percentileBuffer;
 	cv::Mat *aim_temp;
 	int num_kernels, kernel_size, num_channels;
 	bool gotKernel;
@@ -72,6 +85,9 @@ private:
 
 	//******************* BP Params ***********************
 	int num_bins;
+	//buffers kept between service calls to avoid reallocating per request
+	ConversionWorkspace workspace;
+	cv::Mat bpImage, bpTemplate, bpNormImage, bpNormTemplate, bpHistogram, bpProjection, bpResult;
 	std::unique_ptr<ros::NodeHandle> rosNode;
 	ros::ServiceServer getAIMSrv, getBackProjSrv;
 	std::string  getAIMService, getBackProjService;
@@ -15,6 +15,7 @@
 #include <sstream>
 #include <string>
 #include <iostream>
+#include <atomic>
 
 // ROS libraries
 #include "ros/ros.h"
@@ -42,6 +43,7 @@
 #include <saliency/GetAIM.h> // include if use ros package
 #include "opencv2/opencv.hpp"
 #include "opencv2/imgproc/imgproc.hpp"
+#include "opencv2/core/hal/intrin.hpp"
 
 
 #define UNKNOWN_SPACE_FLAG -1
@@ -49,11 +51,76 @@
 #define CHANNEL_WISE 2
 #define OPPONENT_AXIS 3
 #define COMPREHENSIVE 4
+#define PIXEL_WISE_LUT 5
 #define PI 3.14159265359
 
 enum colorSpace {RGB=0, HSV, Lab, Luv, HSI, HSL, CMY, C1C2C3, COPP, YCrCb, YIQ, XYZ, UVW, YUV,
     OPP, NOPP, xyY, rg, YES, I1I2I3};
 
+//Scratch buffers reused by the conversion routines between calls
+struct ConversionWorkspace
+{
+	cv::Mat scaled, converted;
+	std::vector<cv::Mat> planes;
+};
+
+//Counts the cv::Mat buffers allocated by the threads inside a Scope, the other threads are not
+//counted. install() makes it the default allocator once, before the threads that allocate start,
+//and it is never removed since the buffers can outlive any user. The buffers are allocated by the
+//standard allocator. Used to check that the per-frame saliency calls do not allocate once their
+//buffers have been sized.
+class AllocationCounter : public cv::MatAllocator
+{
+public:
+#if CV_VERSION_MAJOR >= 4
+	typedef cv::AccessFlag AccessFlags;
+#else
+	typedef int AccessFlags;
+#endif
+	//counts the allocations of the calling thread into total while it lives
+	class Scope
+	{
+	public:
+		Scope(std::atomic<size_t> &total);
+		~Scope();
+	private:
+		std::atomic<size_t> *previous;
+	};
+	static void install();
+
+	cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+			AccessFlags flags, cv::UMatUsageFlags usageFlags) const;
+	bool allocate(cv::UMatData* data, AccessFlags accessFlags, cv::UMatUsageFlags usageFlags) const;
+	void deallocate(cv::UMatData* data) const;
+
+private:
+	static thread_local std::atomic<size_t> *counter;
+};
+
+//Running estimate of a percentile of 8-bit maps over a stream of frames. Each frame is added as a
+//histogram and older frames are forgotten exponentially. Trackers filled from separate tiles or
+//threads can be merged into one. threshold() decides from the frames seen so far and adds the new
+//one while it applies the threshold, so a frame costs a single pass.
+class PercentileTracker
+{
+public:
+	PercentileTracker(double decay = 0.9);
+	void reset();
+	void forget();
+	void accumulate(const cv::Mat &map);
+	void threshold(const cv::Mat &map, cv::Mat &binary, double percent);
+	void merge(const PercentileTracker &other);
+	float percentile(double percent) const;
+	double count() const { return total; }
+
+	double decay;
+private:
+	int rank(double r) const;
+
+	double counts[256];
+	double total;
+};
+
 class Attention
 {
 public:
@@ -62,19 +129,29 @@ public:
 
 	//****************************** Utilities ******************************
 	cv::Mat imageConversion(cv::Mat inputImg,colorSpace type, bool norm = true);
+	void imageConversion(const cv::Mat &inputImg, cv::Mat &output, colorSpace type,
+			ConversionWorkspace &ws, bool norm = true);
 	cv::Mat normalizeImage(cv::Mat RGBImage ,int method = PIXEL_WISE);
+	void normalizeImage(const cv::Mat &RGBImage, cv::Mat &output, int method = PIXEL_WISE);
 	void normalizeHistogram(cv::Mat &histogram);
 	cv::Mat percentileThreshold(cv::Mat salMap, double percentile);
+	void percentileThreshold(const cv::Mat &salMap, cv::Mat &salMapBinary, double percentile);
 	std::vector<std::string> getFilesAndDirectories(std::string path, std::vector<std::string> &files);
 	void rotation2D(double &y, double &x, double angle);
 	sensor_msgs::Image fillImageMsgs(cv::Mat image, std::string imgName);
 	cv::Mat getImageFromMsg(sensor_msgs::Image msg);
 	//****************************** Methods ******************************
 	cv::Mat getBackProj(cv::Mat imageInput, cv::Mat temp, std::string cSpace, bool normal = false, int bins = 64, bool thresh = true);
+	void getBackProj(const cv::Mat &imageInput, const cv::Mat &temp, cv::Mat &backProjectedImage,
+			std::string cSpace, bool normal = false, int bins = 64, bool thresh = true);
 	cv::Mat getAIM(cv::Mat imageInput, float percent, float scale_factor = 1,
 			std::string basisName = "../21infomax950.bin");
+	void getAIM(const cv::Mat &imageInput, cv::Mat &aimMap, float percent, float scale_factor = 1,
+			std::string basisName = "../21infomax950.bin");
 	void loadBasis(std::string filename);
 	cv::Mat runAIM();
+	void runAIM(cv::Mat &aimMap);
+	void setStreamingPercentile(bool enable, double decay = 0.9);
 
 	//*********************************** ROS Version **********************************************
 	bool getAIMROS(cv::Mat inputImg, cv::Mat &infoMap, float percent = 0.f,
@@ -89,6 +166,8 @@ public:
 	std::vector<std::string> _colors;
 	cv::Mat adj_sm;
 private:
+	void releaseBasis();
+
 	cv::Mat **kernels;
 	float* data;
 	float scale, percentile;
@@ -100,6 +179,18 @@ private:
 	std::string _namespace;
 	int counter;
 	double maxVal, minVal, max_aim, min_aim;
+	std::string basisFile;
+
+	//buffers kept between calls to avoid reallocating per frame. getAIM and getBackProj use
+	//separate buffers, so one of each can run concurrently on the same object
+	ConversionWorkspace workspace;
+	cv::Mat bpImage, bpTemplate, bpNormImage, bpNormTemplate, bpHistogram, bpProjection;
+	cv::Mat scaledInput, smByte, smBordered, percentileBuffer;
+	std::vector<cv::Mat> floatChannels;
+
+	//percentile of the AIM map tracked over frames instead of computed per frame
+	bool streamingPercentile;
+	PercentileTracker aimPercentile;
 
 };
 
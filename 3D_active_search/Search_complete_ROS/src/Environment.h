@@ -9,8 +9,20 @@
 
 #include "EnvConfig.h"
 #include "Attention.h"
+#include "SaliencyProducer.h"
+#include "SaliencyCache.h"
+#include "VoxelGrid.h"
+#include "VoxelMask.h"
+#include <future>
+#include <map>
+#include <memory>
+#include <queue>
+#include <unordered_map>
 #define UNKNOWN_SPACE_FLAG -1
 #define SQR(X) ((X)*(X))
+#define MAX_FRUSTUM_TEMPLATES 512
+#define MAX_POLICY_MASSES 65536
+#define SECTOR_BINS_PER_DEGREE 2
 
 class CameraViewDirection
 {
@@ -41,6 +53,61 @@ struct BestPolicy
 	CameraViewDirection direction;
 	double util, prob, cost;
 	double distance;
+	double completeness = 1.;	//fraction of the policies known not to beat this one
+};
+// Voxels k0 <= k < k1 of the column at offset (di, dj) from the viewpoint
+struct FrustumRun
+{
+	int di, dj, k0, k1;
+};
+// The voxels a direction sees only depend on the direction, the fractional part of the
+// viewpoint and its height, so one template serves every location with the same key
+struct FrustumKey
+{
+	float corrPan, tilt;
+	double fx, fy, z;
+	bool operator<(const FrustumKey &other) const
+	{
+		if (corrPan != other.corrPan) return corrPan < other.corrPan;
+		if (tilt != other.tilt) return tilt < other.tilt;
+		if (fx != other.fx) return fx < other.fx;
+		if (fy != other.fy) return fy < other.fy;
+		return z < other.z;
+	}
+};
+// A direction seen from the cell (x, y) of the grid
+struct PolicyKey
+{
+	int x, y;
+	FrustumKey frustum;
+	bool operator<(const PolicyKey &other) const
+	{
+		if (x != other.x) return x < other.x;
+		if (y != other.y) return y < other.y;
+		return frustum < other.frustum;
+	}
+};
+// Stored mass a policy saw and the columns its frustum covers
+struct PolicyMass
+{
+	double mass;
+	cv::Rect bounds;
+};
+// Voxels a simulated plan has looked at, on top of the search map. Each action adds a layer over
+// the one of the plan it extends, so the plans of a beam share what they have in common.
+struct PlanView
+{
+	std::shared_ptr<const PlanView> parent;
+	std::unordered_map<int, std::vector<std::pair<int, int> > > cleared;	//column j*cols+i -> runs k0, k1
+};
+// A plan of the lookahead search. prob is the probability the plan sees and cost its time.
+struct PlanNode
+{
+	std::vector<int> actions;	//location*directions + direction
+	std::vector<BestPolicy> policies;
+	std::shared_ptr<const PlanView> view;
+	double prob, cost;
+	double score() const { return (cost == 0) ? prob : prob/cost; }
 };
 struct ProbabilityLocations
 {
@@ -54,6 +121,10 @@ struct ProbabilityLocations
 
 
 class Environment {
+	friend class PolicyEvaluation;
+	friend class DirectionEvaluation;
+	friend class PlanExpansion;
+	friend class CandidateEvaluation;
 public:
 	Environment();
 	Environment(EnvConfig &c);
@@ -62,6 +133,13 @@ public:
 
 	//Global Functions
 	static float getAngleOfVector(cv::Point2d origin, cv::Point2d p);
+	static bool outsideView(float corrPan, float angH, double HFOV)
+	{
+		return fabs(corrPan - angH) > HFOV
+				&& fabs(corrPan + 360 - angH) > HFOV
+				&& fabs(corrPan - 360 - angH) > HFOV;
+	}
+	static cv::Rect wedgeBounds(cv::Point2d origin, float corrPan, double HFOV, double range);
 	static float keepAngleWithin180( float angle )
 	{
 		double intpart;
@@ -103,13 +181,34 @@ public:
         _PTConfig.tilt = tilt;
        }
 	SearchConfig::searchMethod getMethod(){return method;}
+	//cv::Mat buffers AIM and backprojection allocated for the last saliency map, counted when
+	//SaliencyConfig::countAllocations is set and 0 otherwise
+	size_t getSaliencyAllocations() const { return _saliencyAllocations; }
+	//only the greedy search with frustumScoring keeps the deadline, lookAhead keeps PlannerConfig::budget
+	//and lookMove evaluates every policy. 0 lets the greedy search evaluate every policy
+	void setPlanningDeadline(double seconds) { _planningDeadline = seconds; }
 
     //search
 	std::vector<BestPolicy> chooseBestAction(std::vector<CameraViewDirection> directions);
 	std::vector<BestPolicy> chooseBestActionGreedy(std::vector<CameraViewDirection> directions);
 	std::vector<BestPolicy> chooseBestActionLookMove(std::vector<CameraViewDirection> directions);
+	std::vector<BestPolicy> chooseBestActionLookAhead(std::vector<CameraViewDirection> directions);
+	std::vector<BestPolicy> chooseBestActionAnytime(std::vector<CameraViewDirection> directions, int64 deadline);
 	std::vector<CameraViewDirection>buildListOfViewDirections();
 	void updateEnvironment();
+	void materialize();
+	//the obstacle map is only changed through these, so the reachable cells are kept up to date
+	const VoxelGrid<float> &getObstacleMap() const { return _obstacleMap; }
+	void setObstacle(int j, int i, int k, float value)
+	{
+		_obstacleMap.set(j, i, k, value);
+		_reachabilityDirty = true;
+	}
+	void setObstacleMap(const VoxelGrid<float> &obstacleMap)
+	{
+		_obstacleMap = obstacleMap;
+		_reachabilityDirty = true;
+	}
 	cv::Mat visualizeEnvironment();
 	void search();
 
@@ -119,25 +218,93 @@ private:
 	void clearAll();
 	//Search
 	void  buildLocationList(std::vector<ProbabilityLocations> &pointList);
+	void updateReachability();
+	void updateTravelField(int64 deadline = 0);
+	double planMass(const std::vector<FrustumRun> &runs, int x, int y, const PlanView *view);
+	std::shared_ptr<const PlanView> planLook(const std::vector<FrustumRun> &runs, int x, int y,
+			const std::shared_ptr<const PlanView> &parent);
+	bool expandPlan(const PlanNode &node, int action, const std::vector<ProbabilityLocations> &pointList,
+			const std::vector<CameraViewDirection> &directions, PlanNode &child);
     std::vector<CameraViewDirection> generatePolicies(cv::Point3d location, std::vector<CameraViewDirection> directions);
     double calculateProbabilityOfViewPoint(CameraViewDirection &dir, cv::Point3d probLocs);
+    PolicyKey policyKey(const CameraViewDirection &dir, cv::Point3d probLocs);
+    bool cachedProbability(const CameraViewDirection &dir, cv::Point3d probLocs, double &prob);
+    std::shared_ptr<const std::vector<FrustumRun> > getFrustumTemplate(float corrPan, float tilt, cv::Point3d probLocs);
+    void buildSectorHistogram(cv::Point3d location, cv::Mat &hist, cv::Mat &sums);
+    double sectorProbability(const cv::Mat &sums, float corrPan, float tilt);
     float estimateCost(float pan, float dirPan, cv::Point3d location);
     BestPolicy chooseBestPolicy(std::vector<ProbabilityLocations> pointList);
     BestPolicy chooseBestPolicy(std::vector<CameraViewDirection> directions);
+    BestPolicy chooseBestPolicyBounded(std::vector<ProbabilityLocations> &pointList,
+    		const std::vector<CameraViewDirection> &directions, int &evaluated);
+    size_t evaluateByEstimate(const std::vector<ProbabilityLocations> &pointList,
+    		const std::vector<CameraViewDirection> &directions, int64 deadline, int keep,
+    		std::vector<CameraViewDirection> &views, std::vector<int> &ids);
+    void buildMassPyramid();
+    double massBound(cv::Point3d location, float corrPan, int level);
     double computeTotalProbVisibleFromPoint(ProbabilityLocations &point);
-    cv::Mat generateSaliencyMap();
-    cv::Mat imageToMap(cv::Mat salMap);
+    void computeProbVisibleMap(cv::Mat &visible);
+    void clearRun(int j, int i, int k0, int k1);
+    SaliencyMaps generateSaliencyMap();
+    SaliencyMaps generateSaliencyMap(const cv::Mat &image);
+    void setSaliency(const SaliencyMaps &maps);
+    void imageToMap(const cv::Mat &salMap);
     cv::Mat transformation2D(cv::Mat depthImg);
     cv::Mat clearNanInf(cv::Mat matrix);
-    cv::Mat map3dTo2d(cv::Mat map);
+    cv::Mat map3dTo2d(const VoxelGrid<float> &map);
 
 public:
-    cv::Mat _obstacleMap, _envImage,_saliencyImg;
+    cv::Mat _envImage;
+    //saliency of the last frame search() collected, from the saliency thread or the cache
+    cv::Mat _saliencyImg;
+    cv::Mat _saliencyProb;	//saliency image normalized to sum to one
     Attention* _saliency;
 private:
-	cv::Mat _environment3D;
-	cv::Mat _saliencyMap;
-	cv::Mat _envTransform;
+	//buffers of the saliency stage kept between frames
+	cv::Mat _aimMap, _bpMap, _maskedImage, _bpTemplate;
+	std::string _bpTemplatePath;
+	std::atomic<size_t> _saliencyAllocations;
+	//runs of voxels seen by each direction, built once per key. The policies are evaluated
+	//in parallel, so the templates are shared and the map is guarded by the mutex.
+	std::map<FrustumKey, std::shared_ptr<const std::vector<FrustumRun> > > _frustumTemplates;
+	cv::Mutex _frustumMutex;
+	//the probability of a voxel is its stored value times _envScale. _envMass is the sum of the
+	//stored values and _envLive the number of voxels that are still positive.
+	VoxelGrid<double> _environment3D;
+	//bricks of _environment3D written by clearRun since they were last compacted
+	std::vector<size_t> _clearedBricks;
+	double _envScale, _envMass;
+	size_t _envLive;
+	//bit of every voxel that still holds probability. While _envUniform is set all of them store
+	//_envUniformValue and the mass of a run is its number of bits times that value.
+	VoxelMask _liveMask;
+	bool _envUniform;
+	double _envUniformValue;
+	//sum of the stored values of every column (j, i), kept up to date with the search map
+	cv::Mat _columnMass;
+	//ones on the cells within the recognition annulus of the center cell
+	cv::Mat _annulusKernel;
+	//_massPyramid[l] sums blocks of 2^(l+1) x 2^(l+1) columns of _columnMass
+	std::vector<cv::Mat> _massPyramid;
+	bool _branchAndBound;
+	double _planningDeadline;
+	//stored mass of the evaluated policies. Between steps the scale is applied to them and only
+	//those whose frustum overlaps the columns cleared since (_dirty) are evaluated again.
+	std::map<PolicyKey, PolicyMass> _policyMasses;
+	cv::Mutex _policyMassMutex;
+	cv::Rect _dirty;
+	VoxelGrid<float> _obstacleMap;
+	//distance of every cell to the closest cell with an obstacle below the height of the robot and
+	//the connected regions of the cells the robot fits in, recomputed when the obstacle map changes
+	cv::Mat _clearance, _reachLabels;
+	bool _reachabilityDirty;
+	//shortest distance in mm from the cell of the robot to every cell, through the cells the robot
+	//fits in. Computed once per planning step, unreachable cells are infinite. A field cut by its
+	//deadline is only exact up to _travelRadius, farther cells are costed by straight line.
+	cv::Mat _travelField;
+	float _travelRadius;
+	VoxelGrid<float> _saliencyMap;
+	VoxelGrid<cv::Vec3f> _envTransform;
 	float _voxelSize;
 	float _recMaxRange,_recMinRange;
 	cv::Point2d _robotPos;	//robot position is kept in mm
@@ -145,9 +312,12 @@ private:
 	CameraConfig _CamConfig;
 	PanTiltConfig _PTConfig;
 	RobotConfig _RobConfig;
+	SaliencyConfig _SalConfig;
+	PlannerConfig _PlanConfig;
 	bool _firstAttemptUknown;
 	static Environment*_instance;
 	SearchConfig::searchMethod method;
+	SearchConfig::scoringMethod scoring;
 	double searchThreshold;
 	int _envMapSize[3];
 
@@ -0,0 +1,68 @@
+/*
+ * SaliencyCache.h
+ *
+ *      Author: Amir Rasouli
+ *      email: aras@eecs.yorku.ca
+ */
+
+#ifndef SALIENCYCACHE_H_
+#define SALIENCYCACHE_H_
+
+#include <opencv2/opencv.hpp>
+#include <list>
+#include <unordered_map>
+
+// Image space results of a saliency computation: the 8-bit blend of AIM and backprojection and the
+// blend normalized to a probability map
+struct SaliencyMaps
+{
+	cv::Mat image, prob;
+	size_t bytes() const {return image.total()*image.elemSize() + prob.total()*prob.elemSize();}
+};
+
+// Viewpoint the saliency was generated from. Position and angles are quantized and the image
+// is summarized by a 64 bit average hash of its 8x8 downsampled gray version.
+struct SaliencyKey
+{
+	int x, y, dir, pan, tilt;
+	uint64_t fingerprint;
+	bool operator==(const SaliencyKey &other) const
+	{
+		return x == other.x && y == other.y && dir == other.dir && pan == other.pan
+				&& tilt == other.tilt && fingerprint == other.fingerprint;
+	}
+};
+struct SaliencyKeyHash
+{
+	size_t operator()(const SaliencyKey &key) const;
+};
+
+// Least recently used cache of saliency maps keyed by viewpoint, limited to a number of bytes.
+// Maps larger than the whole limit are not admitted and counted as rejected.
+class SaliencyCache
+{
+public:
+	SaliencyCache(size_t maxBytes = 0, double positionStep = 100., double angleStep = 1.);
+
+	SaliencyKey makeKey(cv::Point2d robotPos, float robotDir, float pan, float tilt, const cv::Mat &image) const;
+	bool lookup(const SaliencyKey &key, SaliencyMaps &maps);
+	bool insert(const SaliencyKey &key, const SaliencyMaps &maps);
+	void clear();
+
+	size_t hits() const {return _hits;}
+	size_t misses() const {return _misses;}
+	size_t rejected() const {return _rejected;}
+	size_t bytes() const {return _bytes;}
+	size_t size() const {return _entries.size();}
+
+private:
+	typedef std::list<std::pair<SaliencyKey, SaliencyMaps> > EntryList;
+
+	size_t _maxBytes, _bytes;
+	size_t _hits, _misses, _rejected;
+	double _positionStep, _angleStep;
+	EntryList _entries;	//most recently used first
+	std::unordered_map<SaliencyKey, EntryList::iterator, SaliencyKeyHash> _index;
+};
+
+#endif /* SALIENCYCACHE_H_ */
@@ -0,0 +1,49 @@
+/*
+ * SaliencyProducer.h
+ *
+ *      Author: Amir Rasouli
+ *      email: aras@eecs.yorku.ca
+ */
+
+#ifndef SALIENCYPRODUCER_H_
+#define SALIENCYPRODUCER_H_
+
+#include "EnvConfig.h"
+#include "SaliencyCache.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Generates saliency maps on a worker thread so the search can plan while the map of the last
+// frame is computed. Frames are passed through a single slot mailbox: a frame that has not been
+// started yet is replaced by a newer one. How collect() treats a map that is not finished yet is
+// set by the consistency policy in SaliencyConfig.
+class SaliencyProducer
+{
+public:
+	typedef std::function<SaliencyMaps(const cv::Mat &)> Job;
+
+	SaliencyProducer(Job job, SaliencyConfig::consistencyPolicy policy = SaliencyConfig::waitFresh);
+	~SaliencyProducer();
+
+	int submit(const cv::Mat &frame);
+	bool collect(SaliencyMaps &maps, int &frameId);
+	void cancel();
+	bool busy();
+
+private:
+	void run();
+
+	Job _job;
+	SaliencyConfig::consistencyPolicy _policy;
+	std::thread _worker;
+	std::mutex _mutex;
+	std::condition_variable _cond;
+	cv::Mat _pending, _working;
+	SaliencyMaps _result;
+	bool _hasPending, _running, _stop;
+	int _submittedId, _pendingId, _runningId, _resultId, _collectedId, _cancelledId;
+};
+
+#endif /* SALIENCYPRODUCER_H_ */
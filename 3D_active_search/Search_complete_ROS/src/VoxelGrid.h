@@ -0,0 +1,205 @@
+/*
+ * VoxelGrid.h
+ *
+ *      Author: Amir Rasouli
+ *      email: aras@eecs.yorku.ca
+ */
+
+#ifndef VOXELGRID_H_
+#define VOXELGRID_H_
+
+#include <vector>
+#include <cstddef>
+
+// Sparse 3D grid stored in bricks of 8x8x8 voxels. A brick holds a single value until one of its
+// voxels is written with a different one, then it keeps all of its voxels. Large regions that are
+// never observed (or are all cleared) therefore cost one value per brick.
+// Voxels are addressed as the maps of the environment, (j, i, k) = (row y, column x, height z).
+template <typename T>
+class VoxelGrid
+{
+public:
+	enum
+	{
+		BRICK_BITS = 3,
+		BRICK_SIZE = 1 << BRICK_BITS,
+		BRICK_MASK = BRICK_SIZE - 1,
+		BRICK_VOXELS = BRICK_SIZE * BRICK_SIZE * BRICK_SIZE
+	};
+
+	VoxelGrid()
+	{
+		_size[0] = _size[1] = _size[2] = 0;
+		_bricks[0] = _bricks[1] = _bricks[2] = 0;
+	}
+	VoxelGrid(const int size[3], const T &value)
+	{
+		create(size, value);
+	}
+
+	void create(const int size[3], const T &value)
+	{
+		for (int d = 0; d < 3; d++)
+		{
+			_size[d] = size[d];
+			_bricks[d] = (size[d] + BRICK_MASK) >> BRICK_BITS;
+		}
+		_brick.assign((size_t)_bricks[0] * _bricks[1] * _bricks[2], Brick());
+		fill(value);
+	}
+	void release()
+	{
+		std::vector<Brick>().swap(_brick);
+		_size[0] = _size[1] = _size[2] = 0;
+		_bricks[0] = _bricks[1] = _bricks[2] = 0;
+	}
+	void fill(const T &value)
+	{
+		for (size_t b = 0; b < _brick.size(); b++)
+		{
+			_brick[b].value = value;
+			std::vector<T>().swap(_brick[b].voxels);
+		}
+	}
+	bool empty() const { return _brick.empty(); }
+	int size(int dim) const { return _size[dim]; }
+
+	T get(int j, int i, int k) const
+	{
+		const Brick &brick = _brick[brickIndex(j, i, k)];
+		return brick.voxels.empty() ? brick.value : brick.voxels[voxelIndex(j, i, k)];
+	}
+	void set(int j, int i, int k, const T &value)
+	{
+		Brick &brick = _brick[brickIndex(j, i, k)];
+		if (brick.voxels.empty())
+		{
+			if (brick.value == value)
+				return;
+			brick.voxels.assign(BRICK_VOXELS, brick.value);
+		}
+		brick.voxels[voxelIndex(j, i, k)] = value;
+	}
+	// Reference to a voxel, its brick is expanded if it holds a single value
+	T &at(int j, int i, int k)
+	{
+		Brick &brick = _brick[brickIndex(j, i, k)];
+		if (brick.voxels.empty())
+			brick.voxels.assign(BRICK_VOXELS, brick.value);
+		return brick.voxels[voxelIndex(j, i, k)];
+	}
+
+	// Replaces every voxel v by op(v). Single valued bricks are changed once.
+	template <typename Op>
+	void transform(Op op)
+	{
+		for (int bj = 0; bj < _bricks[0]; bj++)
+			for (int bi = 0; bi < _bricks[1]; bi++)
+				for (int bk = 0; bk < _bricks[2]; bk++)
+				{
+					Brick &brick = _brick[((size_t)bj * _bricks[1] + bi) * _bricks[2] + bk];
+					if (brick.voxels.empty())
+					{
+						brick.value = op(brick.value);
+						continue;
+					}
+					for (size_t v = 0; v < brick.voxels.size(); v++)
+						brick.voxels[v] = op(brick.voxels[v]);
+					compactBrick(bj, bi, bk);
+				}
+	}
+
+	// Number of voxels inside the grid that are not zero
+	size_t countNonZero() const
+	{
+		size_t count = 0;
+		for (int bj = 0; bj < _bricks[0]; bj++)
+			for (int bi = 0; bi < _bricks[1]; bi++)
+				for (int bk = 0; bk < _bricks[2]; bk++)
+				{
+					const Brick &brick = _brick[((size_t)bj * _bricks[1] + bi) * _bricks[2] + bk];
+					int ej = extent(bj, 0), ei = extent(bi, 1), ek = extent(bk, 2);
+					if (brick.voxels.empty())
+					{
+						if (!(brick.value == T()))
+							count += (size_t)ej * ei * ek;
+						continue;
+					}
+					for (int j = 0; j < ej; j++)
+						for (int i = 0; i < ei; i++)
+							for (int k = 0; k < ek; k++)
+								if (!(brick.voxels[(((j << BRICK_BITS) | i) << BRICK_BITS) | k] == T()))
+									count++;
+				}
+		return count;
+	}
+
+	// Index of the brick that holds voxel (j, i, k)
+	size_t brickOf(int j, int i, int k) const { return brickIndex(j, i, k); }
+	// Turns the given bricks back to single valued ones if all their voxels have the same value
+	void compact(const std::vector<size_t> &bricks)
+	{
+		for (size_t n = 0; n < bricks.size(); n++)
+		{
+			size_t b = bricks[n];
+			compactBrick(b / ((size_t)_bricks[1] * _bricks[2]), (b / _bricks[2]) % _bricks[1], b % _bricks[2]);
+		}
+	}
+
+	size_t denseBricks() const
+	{
+		size_t count = 0;
+		for (size_t b = 0; b < _brick.size(); b++)
+			if (!_brick[b].voxels.empty())
+				count++;
+		return count;
+	}
+	size_t memoryBytes() const
+	{
+		return _brick.size() * sizeof(Brick) + denseBricks() * BRICK_VOXELS * sizeof(T);
+	}
+
+private:
+	struct Brick
+	{
+		T value;
+		std::vector<T> voxels;	// empty while the whole brick is value
+	};
+
+	size_t brickIndex(int j, int i, int k) const
+	{
+		return ((size_t)(j >> BRICK_BITS) * _bricks[1] + (i >> BRICK_BITS)) * _bricks[2] + (k >> BRICK_BITS);
+	}
+	static int voxelIndex(int j, int i, int k)
+	{
+		return ((((j & BRICK_MASK) << BRICK_BITS) | (i & BRICK_MASK)) << BRICK_BITS) | (k & BRICK_MASK);
+	}
+	// Number of voxels of brick b along dim that are inside the grid
+	int extent(int b, int dim) const
+	{
+		int rest = _size[dim] - (b << BRICK_BITS);
+		return rest < BRICK_SIZE ? rest : BRICK_SIZE;
+	}
+	void compactBrick(int bj, int bi, int bk)
+	{
+		Brick &brick = _brick[((size_t)bj * _bricks[1] + bi) * _bricks[2] + bk];
+		if (brick.voxels.empty())
+			return;
+		// voxels of the bricks on the border that fall outside the grid are not compared
+		int ej = extent(bj, 0), ei = extent(bi, 1), ek = extent(bk, 2);
+		const T first = brick.voxels[0];
+		for (int j = 0; j < ej; j++)
+			for (int i = 0; i < ei; i++)
+				for (int k = 0; k < ek; k++)
+					if (!(brick.voxels[(((j << BRICK_BITS) | i) << BRICK_BITS) | k] == first))
+						return;
+		brick.value = first;
+		std::vector<T>().swap(brick.voxels);
+	}
+
+	int _size[3];
+	int _bricks[3];
+	std::vector<Brick> _brick;
+};
+
+#endif /* VOXELGRID_H_ */
@@ -0,0 +1,125 @@
+/*
+ * VoxelMask.h
+ *
+ *      Author: Amir Rasouli
+ *      email: aras@eecs.yorku.ca
+ */
+
+#ifndef VOXELMASK_H_
+#define VOXELMASK_H_
+
+#include <vector>
+#include <stdint.h>
+#include <cstddef>
+
+// One bit per voxel. The bits of a column (j, i) are packed along the height k in 64 bit words,
+// so runs of a column are counted and cleared a word at a time.
+class VoxelMask
+{
+public:
+	VoxelMask()
+	{
+		_size[0] = _size[1] = _size[2] = 0;
+		_columnWords = 0;
+	}
+
+	void create(const int size[3], bool value)
+	{
+		for (int d = 0; d < 3; d++)
+			_size[d] = size[d];
+		_columnWords = (size[2] + 63) >> 6;
+		_words.assign((size_t)size[0] * size[1] * _columnWords, 0);
+		if (value)
+			for (int j = 0; j < size[0]; j++)
+				for (int i = 0; i < size[1]; i++)
+					setRun(j, i, 0, size[2]);
+	}
+	void release()
+	{
+		std::vector<uint64_t>().swap(_words);
+		_size[0] = _size[1] = _size[2] = 0;
+		_columnWords = 0;
+	}
+	int size(int dim) const { return _size[dim]; }
+
+	bool get(int j, int i, int k) const
+	{
+		return (column(j, i)[k >> 6] >> (k & 63)) & 1;
+	}
+	void set(int j, int i, int k, bool value)
+	{
+		uint64_t bit = (uint64_t)1 << (k & 63);
+		uint64_t &word = column(j, i)[k >> 6];
+		word = value ? (word | bit) : (word & ~bit);
+	}
+
+	// Number of set voxels k0 <= k < k1 of a column
+	int count(int j, int i, int k0, int k1) const
+	{
+		const uint64_t *words = column(j, i);
+		int res = 0;
+		for (int w = k0 >> 6; k0 < k1; w++)
+		{
+			int end = (k1 < ((w + 1) << 6)) ? k1 : ((w + 1) << 6);
+			res += __builtin_popcountll(words[w] & runBits(k0, end));
+			k0 = end;
+		}
+		return res;
+	}
+	// Clears the voxels k0 <= k < k1 of a column and returns how many of them were set
+	int clear(int j, int i, int k0, int k1)
+	{
+		uint64_t *words = column(j, i);
+		int res = 0;
+		for (int w = k0 >> 6; k0 < k1; w++)
+		{
+			int end = (k1 < ((w + 1) << 6)) ? k1 : ((w + 1) << 6);
+			uint64_t bits = runBits(k0, end);
+			res += __builtin_popcountll(words[w] & bits);
+			words[w] &= ~bits;
+			k0 = end;
+		}
+		return res;
+	}
+	// Number of set voxels of the whole mask
+	size_t count() const
+	{
+		size_t res = 0;
+		for (size_t w = 0; w < _words.size(); w++)
+			res += __builtin_popcountll(_words[w]);
+		return res;
+	}
+
+private:
+	// bits k0 <= k < k1 of the word holding k0, k1 is at most the end of that word
+	static uint64_t runBits(int k0, int k1)
+	{
+		int n = k1 - k0;
+		uint64_t bits = (n >= 64) ? ~(uint64_t)0 : (((uint64_t)1 << n) - 1);
+		return bits << (k0 & 63);
+	}
+	void setRun(int j, int i, int k0, int k1)
+	{
+		uint64_t *words = column(j, i);
+		for (int w = k0 >> 6; k0 < k1; w++)
+		{
+			int end = (k1 < ((w + 1) << 6)) ? k1 : ((w + 1) << 6);
+			words[w] |= runBits(k0, end);
+			k0 = end;
+		}
+	}
+	uint64_t *column(int j, int i)
+	{
+		return &_words[((size_t)j * _size[1] + i) * _columnWords];
+	}
+	const uint64_t *column(int j, int i) const
+	{
+		return &_words[((size_t)j * _size[1] + i) * _columnWords];
+	}
+
+	int _size[3];
+	int _columnWords;
+	std::vector<uint64_t> _words;
+};
+
+#endif /* VOXELMASK_H_ */